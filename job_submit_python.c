@@ -23,66 +23,3511 @@
 #include "slurm/slurm.h"
 #include "slurm/slurm_errno.h"
 
+#include "src/common/hostlist.h"
+#include "src/common/parse_config.h"
+#include "src/common/parse_time.h"
 #include "src/common/read_config.h"
 #include "src/common/xstring.h"
 #include "src/common/xmalloc.h"
 #include "src/slurmctld/slurmctld.h"
 
+#if SLURM_VERSION_NUMBER >= SLURM_VERSION_NUM(17,11,0)
+#include "src/common/group_cache.h"
+#endif
+
+#include <errno.h>
+#include <grp.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <pwd.h>
 #include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#if SLURM_VERSION_NUMBER < SLURM_VERSION_NUM(17,11,0)
+#define NO_VAL8 (0xfe)
+#endif
+
+const char plugin_name[]="Job submit Python plugin";
+const char plugin_type[] = "job_submit/python";
+const uint32_t plugin_version = SLURM_VERSION_NUMBER;
+
+#ifndef JOB_SUBMIT_PYTHON_NO_LOCK
+static pthread_mutex_t python_lock = PTHREAD_MUTEX_INITIALIZER;
+#else
+/*
+ * Without ``python_lock`` the policy runs in parallel, so a module is only
+ * reloaded when its file has changed, and by one thread at a time
+ */
+static pthread_mutex_t load_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct script_version {
+	char *name;
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	struct timespec mtime;
+};
+
+static struct script_version *script_versions = NULL;
+static int script_version_count = 0;
+static pthread_mutex_t script_version_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void script_versions_clear(void);
+#endif
+
+/*
+ * The thread state of the thread which initialised Python, saved while the
+ * GIL is released for the other threads
+ */
+static PyThreadState *main_thread_state = NULL;
+
+void print_python_error();
+PyObject* char_star_star_to_python(uint32_t num_strings, char** str_list);
+PyObject* load_script(const char *script_name);
+
+/*
+ * Settings read from ``job_submit_python.conf`` in the script directory
+ */
+struct python_conf {
+	char *trace_file;		/* write trace events here, if set */
+	uint32_t trace_sample;		/* trace one in this many calls */
+	uint32_t trace_min_duration;	/* only keep calls slower than this (ms) */
+	uint32_t trace_max_size;	/* rotate the trace file at this size (MB) */
+	uint32_t profile_interval;	/* sample the script this often (ms) */
+	char *profile_file;		/* write collapsed stacks here, if set */
+	uint32_t profile_dump_interval;	/* write profile_file this often (s) */
+	uint32_t identity_ttl;		/* cache user lookups for this long (s) */
+	uint32_t identity_negative_ttl;	/* cache failed user lookups for this long (s) */
+	char *shadow_module;		/* shadow the live policy with this module, if set */
+	uint32_t shadow_sample;		/* shadow one in this many calls */
+	uint32_t gc_freeze_after;	/* freeze the GC after this many calls */
+	char *gc_threshold;		/* "threshold0,threshold1,threshold2" */
+	uint32_t gc_idle_interval;	/* collect when idle this often (ms), if set */
+	uint32_t memory_budget;		/* limit each call's allocations to this (MB), if set */
+	bool memory_budget_reject;	/* reject jobs whose call went over the budget */
+};
+
+static struct python_conf conf;
+
+static s_p_options_t conf_options[] = {
+	{"TraceFile", S_P_STRING},
+	{"TraceSample", S_P_UINT32},
+	{"TraceMinDuration", S_P_UINT32},
+	{"TraceMaxSize", S_P_UINT32},
+	{"ProfileInterval", S_P_UINT32},
+	{"ProfileFile", S_P_STRING},
+	{"ProfileDumpInterval", S_P_UINT32},
+	{"IdentityCacheTTL", S_P_UINT32},
+	{"IdentityNegativeTTL", S_P_UINT32},
+	{"ShadowModule", S_P_STRING},
+	{"ShadowSample", S_P_UINT32},
+	{"GCFreezeAfter", S_P_UINT32},
+	{"GCThreshold", S_P_STRING},
+	{"GCIdleInterval", S_P_UINT32},
+	{"MemoryBudget", S_P_UINT32},
+	{"MemoryBudgetAction", S_P_STRING},
+	{NULL}
+};
+
+/*
+ * Read ``job_submit_python.conf``, falling back to the defaults for anything
+ * not set or if the file does not exist
+ */
+static void read_python_conf(void)
+{
+	char *conf_path = xstrdup_printf("%s/job_submit_python.conf", DEFAULT_SCRIPT_DIR);
+
+	memset(&conf, 0, sizeof(conf));
+	conf.trace_sample = 1;
+	conf.trace_max_size = 100;
+	conf.profile_dump_interval = 60;
+	conf.identity_ttl = 300;
+	conf.identity_negative_ttl = 60;
+	conf.shadow_sample = 1;
+	conf.gc_freeze_after = 1;
+	conf.memory_budget_reject = true;
+
+	if (access(conf_path, R_OK) == 0)
+	{
+		s_p_hashtbl_t *tbl = s_p_hashtbl_create(conf_options);
+		if (s_p_parse_file(tbl, NULL, conf_path, false) == SLURM_SUCCESS)
+		{
+			s_p_get_string(&conf.trace_file, "TraceFile", tbl);
+			s_p_get_uint32(&conf.trace_sample, "TraceSample", tbl);
+			s_p_get_uint32(&conf.trace_min_duration, "TraceMinDuration", tbl);
+			s_p_get_uint32(&conf.trace_max_size, "TraceMaxSize", tbl);
+			s_p_get_uint32(&conf.profile_interval, "ProfileInterval", tbl);
+			s_p_get_string(&conf.profile_file, "ProfileFile", tbl);
+			s_p_get_uint32(&conf.profile_dump_interval, "ProfileDumpInterval", tbl);
+			s_p_get_uint32(&conf.identity_ttl, "IdentityCacheTTL", tbl);
+			s_p_get_uint32(&conf.identity_negative_ttl, "IdentityNegativeTTL", tbl);
+			s_p_get_string(&conf.shadow_module, "ShadowModule", tbl);
+			s_p_get_uint32(&conf.shadow_sample, "ShadowSample", tbl);
+			s_p_get_uint32(&conf.gc_freeze_after, "GCFreezeAfter", tbl);
+			s_p_get_string(&conf.gc_threshold, "GCThreshold", tbl);
+			s_p_get_uint32(&conf.gc_idle_interval, "GCIdleInterval", tbl);
+			s_p_get_uint32(&conf.memory_budget, "MemoryBudget", tbl);
+
+			char *action = NULL;
+			if (s_p_get_string(&action, "MemoryBudgetAction", tbl))
+			{
+				if (xstrcasecmp(action, "accept") == 0)
+					conf.memory_budget_reject = false;
+				else if (xstrcasecmp(action, "reject") != 0)
+					error("job_submit_python: MemoryBudgetAction must be \"reject\" or \"accept\", not \"%s\"", action);
+				xfree(action);
+			}
+		}
+		else
+		{
+			error("job_submit_python: Could not parse %s, using defaults", conf_path);
+		}
+		s_p_hashtbl_destroy(tbl);
+	}
+
+	if (conf.trace_sample == 0)
+		conf.trace_sample = 1;
+	if (conf.shadow_sample == 0)
+		conf.shadow_sample = 1;
+
+	xfree(conf_path);
+}
+
+/*
+ * Free the memory held by the settings
+ */
+static void free_python_conf(void)
+{
+	xfree(conf.trace_file);
+	xfree(conf.profile_file);
+	xfree(conf.shadow_module);
+	xfree(conf.gc_threshold);
+}
+
+/*
+ * Temporaries created while converting between the job descriptor and Python
+ * are taken from a bump arena which is reset at the end of each call to
+ * ``job_submit()``, rather than being allocated and freed one by one. Each
+ * call takes an arena from ``arena_pool`` and returns it when it finishes so
+ * that concurrent calls do not share one.
+ */
+#define ARENA_BLOCK_SIZE 4096
+
+struct arena_block {
+	struct arena_block *next;
+	size_t size;
+	size_t used;
+	char data[];
+};
+
+struct arena {
+	struct arena *next;		/* next spare arena in the pool */
+	struct arena_block *blocks;
+};
+
+static struct arena *arena_pool = NULL;
+static pthread_mutex_t arena_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Allocate ``size`` bytes from ``arena``. The memory is only valid until the
+ * next call to ``arena_reset()``.
+ */
+static void* arena_alloc(struct arena *arena, size_t size)
+{
+	size = (size + 7) & ~((size_t)7);
+
+	struct arena_block *head = arena->blocks;
+	if (head == NULL || head->size - head->used < size)
+	{
+		size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+		head = xmalloc(sizeof(struct arena_block) + block_size);
+		head->next = arena->blocks;
+		head->size = block_size;
+		head->used = 0;
+		arena->blocks = head;
+	}
+
+	void *ptr = head->data + head->used;
+	head->used += size;
+	return ptr;
+}
+
+/*
+ * Copy the first ``len`` characters of ``str`` into ``arena``
+ */
+static char* arena_strndup(struct arena *arena, const char *str, size_t len)
+{
+	char *copy = arena_alloc(arena, len + 1);
+	memcpy(copy, str, len);
+	copy[len] = '\0';
+	return copy;
+}
+
+/*
+ * Release everything allocated from the arena during this call. If the call
+ * needed more than one block then they are merged into a single block of the
+ * combined size so that the arena settles at its high-water mark instead of
+ * growing and shrinking on every submission.
+ */
+static void arena_reset(struct arena *arena)
+{
+	if (arena->blocks == NULL)
+		return;
+
+	if (arena->blocks->next == NULL)
+	{
+		arena->blocks->used = 0;
+		return;
+	}
+
+	size_t total = 0;
+	while (arena->blocks)
+	{
+		struct arena_block *next = arena->blocks->next;
+		total += arena->blocks->size;
+		xfree(arena->blocks);
+		arena->blocks = next;
+	}
+
+	arena->blocks = xmalloc(sizeof(struct arena_block) + total);
+	arena->blocks->size = total;
+	arena->blocks->used = 0;
+}
+
+/*
+ * Take a spare arena from the pool, or create one if there are none
+ */
+static struct arena* arena_acquire(void)
+{
+	slurm_mutex_lock(&arena_pool_lock);
+	struct arena *arena = arena_pool;
+	if (arena)
+		arena_pool = arena->next;
+	slurm_mutex_unlock(&arena_pool_lock);
+
+	if (arena == NULL)
+		arena = xmalloc(sizeof(struct arena));
+	return arena;
+}
+
+/*
+ * Reset ``arena`` and return it to the pool
+ */
+static void arena_release(struct arena *arena)
+{
+	arena_reset(arena);
+
+	slurm_mutex_lock(&arena_pool_lock);
+	arena->next = arena_pool;
+	arena_pool = arena;
+	slurm_mutex_unlock(&arena_pool_lock);
+}
+
+/*
+ * Free all of the arenas in the pool
+ */
+static void arena_pool_destroy(void)
+{
+	while (arena_pool)
+	{
+		struct arena *next = arena_pool->next;
+		while (arena_pool->blocks)
+		{
+			struct arena_block *block = arena_pool->blocks->next;
+			xfree(arena_pool->blocks);
+			arena_pool->blocks = block;
+		}
+		xfree(arena_pool);
+		arena_pool = next;
+	}
+}
+
+/*
+ * State for a single call into the policy: the messages for the user, the
+ * number of Python errors logged and the arena for temporaries. Each thread
+ * calling into Python has its own, so calls need not be serialised.
+ */
+struct call_context {
+	char *user_msg;
+	int errors;
+	struct arena *arena;
+};
+
+static __thread struct call_context *current_context = NULL;
+
+/*
+ * Set up ``ctx`` as the context for calls made by this thread
+ */
+static void call_context_begin(struct call_context *ctx)
+{
+	memset(ctx, 0, sizeof(struct call_context));
+	ctx->arena = arena_acquire();
+	current_context = ctx;
+}
+
+/*
+ * Finish with ``ctx``. Any user message it still holds is freed.
+ */
+static void call_context_end(struct call_context *ctx)
+{
+	current_context = NULL;
+	arena_release(ctx->arena);
+	xfree(ctx->user_msg);
+}
+
+/*
+ * State of the ``slurm`` module
+ */
+struct slurm_module_state {
+	PyObject *simple_namespace;	/* types.SimpleNamespace */
+};
+
+static struct slurm_module_state* slurm_module_state();
+
+/*
+ * Function to register into Python namespace to allow the plugin writer to
+ * return information to the user running sbatch.
+ */
+static PyObject* slurm_user_msg(PyObject *self, PyObject *arg)
+{
+	const char* msg = PyUnicode_AsUTF8(arg);
+	if (msg == NULL)
+		return NULL;
+
+	struct call_context *ctx = current_context;
+	if (ctx == NULL) {
+		// Not inside job_submit() so there is no user to send it to
+		info("job_submit_python: user_msg outside of job_submit: %s", msg);
+		Py_RETURN_NONE;
+	}
+
+	if (ctx->user_msg) {
+		xstrfmtcat(ctx->user_msg, "\n%s", msg);
+	} else {
+		ctx->user_msg = xstrdup(msg);
+	}
+	Py_RETURN_NONE;
+}
+
+/*
+ * Function to register into Python namespace to allow the plugin writer to
+ * write an info message into the log
+ */
+static PyObject* slurm_info(PyObject *self, PyObject *arg)
+{
+	PyObject* str = PyObject_Str(arg);
+	info("job_submit_python: %s", PyUnicode_AsUTF8(str));
+	Py_DECREF(str);
+	Py_RETURN_NONE;
+}
+
+/*
+ * Function to register into Python namespace to allow the plugin writer to
+ * write an error message into the log
+ */
+static PyObject* slurm_error(PyObject *self, PyObject *arg)
+{
+	PyObject* str = PyObject_Str(arg);
+	error("job_submit_python: %s", PyUnicode_AsUTF8(str));
+	Py_DECREF(str);
+	Py_RETURN_NONE;
+}
+
+/*
+ * Parse a TRES/GRES count such as ``2`` or ``10G`` (using the same binary
+ * suffixes as Slurm). With ``megabytes`` the count is a memory size which,
+ * like Slurm's ``mem`` TRES, is in megabytes when it has no suffix and is
+ * converted to megabytes when it has one. Returns false if ``str`` is not a
+ * count, also raising ValueError if it is a count too large to represent.
+ */
+static bool parse_tres_count(const char *str, bool megabytes, unsigned long long *count)
+{
+	char *end = NULL;
+	int shift = 0;
+
+	if (str == NULL || *str < '0' || *str > '9')
+		return false;
+
+	errno = 0;
+	*count = strtoull(str, &end, 10);
+	bool overflow = errno == ERANGE;
+	switch (*end)
+	{
+		case 'k': case 'K': shift = 10; end++; break;
+		case 'm': case 'M': shift = 20; end++; break;
+		case 'g': case 'G': shift = 30; end++; break;
+		case 't': case 'T': shift = 40; end++; break;
+		case 'p': case 'P': shift = 50; end++; break;
+		default: if (megabytes) shift = 20; break;
+	}
+
+	if (*end != '\0')
+		return false;
+
+	if (megabytes)
+		shift -= 20;
+	if (shift >= 0)
+	{
+		overflow = overflow || *count > (ULLONG_MAX >> shift);
+		*count <<= shift;
+	}
+	else
+	{
+		unsigned long long round = (1ULL << -shift) - 1;
+		overflow = overflow || *count > ULLONG_MAX - round;
+		*count = (*count + round) >> -shift;
+	}
+
+	if (overflow)
+	{
+		PyErr_Format(PyExc_ValueError, "count \"%s\" in TRES specification is too large", str);
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Function to register into Python namespace to allow the plugin writer to
+ * split a TRES or GRES string such as ``gres:gpu:tesla:2,cpu=4`` into a list
+ * of dicts with ``type``, ``name`` and ``count`` keys. A ``gres:`` prefix is
+ * reported using the TRES form of the type, e.g. ``gres/gpu``. The
+ * ``separator`` key holds the ``=`` or ``:`` written before the count (``:``
+ * for the GRES form without one), so that ``format_tres`` can write the same
+ * form back.
+ */
+static PyObject* slurm_parse_tres(PyObject *self, PyObject *arg)
+{
+	const char* str = PyUnicode_AsUTF8(arg);
+	if (str == NULL)
+		return NULL;
+
+	PyObject* list = PyList_New(0);
+	char *copy = xstrdup(str);
+	char *save_ptr = NULL;
+
+	for (char *tok = strtok_r(copy, ",", &save_ptr); tok; tok = strtok_r(NULL, ",", &save_ptr))
+	{
+		unsigned long long count = 1;
+		char *type = tok;
+		char *name = NULL;
+		char *count_str = NULL;
+		const char *separator = ":";
+
+		// Either ``type[:name]=count`` or ``type[:name][:count]``
+		char *eq = strchr(tok, '=');
+		if (eq)
+		{
+			*eq = '\0';
+			count_str = eq + 1;
+			separator = "=";
+		}
+		else
+		{
+			char *last = strrchr(tok, ':');
+			if (last && parse_tres_count(last + 1, false, &count))
+			{
+				*last = '\0';
+				count_str = last + 1;
+			}
+			else if (!last && parse_tres_count(tok, false, &count))
+			{
+				type = NULL;
+			}
+			if (PyErr_Occurred())
+				break;
+		}
+
+		bool megabytes = type && strcmp(type, "mem") == 0;
+		if (count_str && !parse_tres_count(count_str, megabytes, &count))
+		{
+			if (!PyErr_Occurred())
+				PyErr_Format(PyExc_ValueError, "invalid count \"%s\" in TRES specification", count_str);
+			break;
+		}
+		if (type == NULL || *type == '\0')
+		{
+			PyErr_Format(PyExc_ValueError, "missing type in TRES specification \"%s\"", str);
+			break;
+		}
+
+		char *colon = strchr(type, ':');
+		if (colon && strncmp(type, "gres:", 5) == 0)
+		{
+			*colon = '/';
+			colon = strchr(colon + 1, ':');
+		}
+		if (colon)
+		{
+			*colon = '\0';
+			name = colon + 1;
+		}
+
+		PyObject* entry = Py_BuildValue("{s:s,s:z,s:K,s:s}", "type", type, "name", name, "count", count,
+						"separator", separator);
+		if (entry == NULL)
+			break;
+		PyList_Append(list, entry);
+		Py_DECREF(entry);
+	}
+	xfree(copy);
+
+	if (PyErr_Occurred())
+	{
+		Py_DECREF(list);
+		return NULL;
+	}
+	return list;
+}
+
+/*
+ * Function to register into Python namespace to allow the plugin writer to
+ * turn a list of dicts as returned by ``parse_tres`` back into a string.
+ * The count follows the entry's ``separator`` if it has one. Otherwise GRES
+ * are written as ``gres:type[:name]:count`` and everything else as
+ * ``type[:name]=count``, which is how Slurm writes them. The ``gres/``
+ * prefix of the TRES form is only kept with ``=``.
+ */
+static PyObject* slurm_format_tres(PyObject *self, PyObject *arg)
+{
+	PyObject *list = PySequence_Fast(arg, "format_tres expects a sequence of dicts");
+	if (list == NULL)
+		return NULL;
+
+	char *out = NULL;
+	for (int i = 0; i < PySequence_Fast_GET_SIZE(list); ++i)
+	{
+		PyObject* entry = PySequence_Fast_GET_ITEM(list, i);
+		PyObject* p_type = PyMapping_Check(entry) ? PyMapping_GetItemString(entry, "type") : NULL;
+		if (p_type == NULL || !PyUnicode_Check(p_type))
+		{
+			Py_XDECREF(p_type);
+			PyErr_Clear();
+			PyErr_SetString(PyExc_ValueError, "each TRES entry must be a dict with a string \"type\"");
+			break;
+		}
+		PyObject* p_name = PyMapping_HasKeyString(entry, "name") ? PyMapping_GetItemString(entry, "name") : NULL;
+		PyObject* p_count = PyMapping_HasKeyString(entry, "count") ? PyMapping_GetItemString(entry, "count") : NULL;
+		PyObject* p_separator = PyMapping_HasKeyString(entry, "separator") ? PyMapping_GetItemString(entry, "separator") : NULL;
+
+		unsigned long long count = 1;
+		if (p_count && p_count != Py_None)
+			count = PyLong_AsUnsignedLongLong(p_count);
+
+		const char *separator = NULL;
+		if (!PyErr_Occurred() && p_separator && p_separator != Py_None)
+		{
+			separator = PyUnicode_Check(p_separator) ? PyUnicode_AsUTF8(p_separator) : NULL;
+			if (separator == NULL || (strcmp(separator, ":") != 0 && strcmp(separator, "=") != 0))
+			{
+				PyErr_Clear();
+				PyErr_SetString(PyExc_ValueError, "TRES \"separator\" must be \":\" or \"=\"");
+			}
+		}
+
+		if (!PyErr_Occurred())
+		{
+			char *type = xstrdup(PyUnicode_AsUTF8(p_type));
+			bool gres = strncmp(type, "gres/", 5) == 0 || strncmp(type, "gres:", 5) == 0;
+			if (separator == NULL)
+				separator = gres ? ":" : "=";
+
+			// ``gres/gpu`` is written back in the ``gres:gpu`` form used in job descriptors
+			if (gres && strcmp(separator, ":") == 0)
+				type[4] = ':';
+
+			xstrfmtcat(out, "%s%s", out ? "," : "", type);
+			if (p_name && p_name != Py_None)
+			{
+				PyObject* name_str = PyObject_Str(p_name);
+				xstrfmtcat(out, ":%s", PyUnicode_AsUTF8(name_str));
+				Py_DECREF(name_str);
+			}
+			xstrfmtcat(out, "%s%llu", separator, count);
+			xfree(type);
+		}
+
+		Py_DECREF(p_type);
+		Py_XDECREF(p_name);
+		Py_XDECREF(p_count);
+		Py_XDECREF(p_separator);
+
+		if (PyErr_Occurred())
+			break;
+	}
+	Py_DECREF(list);
+
+	if (PyErr_Occurred())
+	{
+		xfree(out);
+		return NULL;
+	}
+
+	PyObject* result = PyUnicode_FromString(out ? out : "");
+	xfree(out);
+	return result;
+}
+
+/*
+ * Create a hostlist from a Python string, raising ValueError if it is invalid
+ */
+static hostlist_t hostlist_from_python(PyObject *arg)
+{
+	const char* str = PyUnicode_AsUTF8(arg);
+	if (str == NULL)
+		return NULL;
+
+	hostlist_t hl = hostlist_create(str);
+	if (hl == NULL)
+		PyErr_Format(PyExc_ValueError, "invalid hostlist \"%s\"", str);
+	return hl;
+}
+
+/*
+ * Function to register into Python namespace to allow the plugin writer to
+ * expand a hostlist such as ``node[01-10]`` into a list of host names
+ */
+static PyObject* slurm_hostlist_expand(PyObject *self, PyObject *arg)
+{
+	hostlist_t hl = hostlist_from_python(arg);
+	if (hl == NULL)
+		return NULL;
+
+	PyObject* list = PyList_New(0);
+	char *host;
+	while ((host = hostlist_shift(hl)))
+	{
+		PyObject* str = PyUnicode_FromString(host);
+		free(host);
+		PyList_Append(list, str);
+		Py_DECREF(str);
+	}
+	hostlist_destroy(hl);
+
+	return list;
+}
+
+/*
+ * Function to register into Python namespace to allow the plugin writer to
+ * count the hosts in a hostlist without expanding it
+ */
+static PyObject* slurm_hostlist_count(PyObject *self, PyObject *arg)
+{
+	hostlist_t hl = hostlist_from_python(arg);
+	if (hl == NULL)
+		return NULL;
+
+	int count = hostlist_count(hl);
+	hostlist_destroy(hl);
+
+	return PyLong_FromLong(count);
+}
+
+/*
+ * Function to register into Python namespace to allow the plugin writer to
+ * turn a sequence of host names into a ranged hostlist string
+ */
+static PyObject* slurm_hostlist_compress(PyObject *self, PyObject *arg)
+{
+	PyObject *list = PySequence_Fast(arg, "hostlist_compress expects a sequence of host names");
+	if (list == NULL)
+		return NULL;
+
+	hostlist_t hl = hostlist_create(NULL);
+	for (int i = 0; i < PySequence_Fast_GET_SIZE(list); ++i)
+	{
+		const char* host = PyUnicode_AsUTF8(PySequence_Fast_GET_ITEM(list, i));
+		if (host == NULL)
+		{
+			hostlist_destroy(hl);
+			Py_DECREF(list);
+			return NULL;
+		}
+		hostlist_push_host(hl, host);
+	}
+	Py_DECREF(list);
+
+	char *ranged = hostlist_ranged_string_xmalloc(hl);
+	hostlist_destroy(hl);
+
+	PyObject* result = PyUnicode_FromString(ranged);
+	xfree(ranged);
+	return result;
+}
+
+/*
+ * Function to register into Python namespace to allow the plugin writer to
+ * turn a time string such as ``1-12:00:00`` into minutes, as used by
+ * ``time_limit``. ``UNLIMITED`` is returned as INFINITE.
+ */
+static PyObject* slurm_parse_time(PyObject *self, PyObject *arg)
+{
+	const char* str = PyUnicode_AsUTF8(arg);
+	if (str == NULL)
+		return NULL;
+
+	int mins = time_str2mins((char*)str);
+	if (mins == (int)NO_VAL)
+	{
+		PyErr_Format(PyExc_ValueError, "invalid time specification \"%s\"", str);
+		return NULL;
+	}
+
+	return PyLong_FromUnsignedLong((uint32_t)mins);
+}
+
+/*
+ * Function to register into Python namespace to allow the plugin writer to
+ * turn a number of minutes back into a Slurm time string
+ */
+static PyObject* slurm_format_time(PyObject *self, PyObject *arg)
+{
+	unsigned long mins = PyLong_AsUnsignedLong(arg);
+	if (PyErr_Occurred())
+		return NULL;
+
+	char time_str[32];
+	mins2time_str((uint32_t)mins, time_str, sizeof(time_str));
+
+	return PyUnicode_FromString(time_str);
+}
+
+/*
+ * Functions registered with ``slurm.every()`` are run on a dedicated plugin
+ * thread, outside ``python_lock``. Each run's return value is published by
+ * swapping the task's ``result`` reference under ``task_lock`` so that the
+ * submit path can pick it up with ``slurm.result()`` without waiting.
+ */
+#define PERIODIC_TASK_MIN_INTERVAL 0.001	/* seconds */
+
+struct periodic_task {
+	char *name;
+	char *module;		/* the module which registered the task, if known */
+	uint64_t generation;	/* the load of the module which registered it, or 0 */
+	PyObject *func;
+	PyObject *result;
+	double interval;
+	struct timespec next_run;
+	uint64_t runs;
+	uint64_t failures;
+	double last_duration;
+	time_t last_success;
+};
+
+static struct periodic_task *tasks = NULL;
+static int task_count = 0;
+static pthread_mutex_t task_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t task_generation = 0;			/* number of module loads so far */
+static __thread uint64_t task_load_generation = 0;	/* the load this thread is running */
+static pthread_cond_t task_cond;
+static pthread_t task_thread;
+static bool task_thread_shutdown = false;
+
+/*
+ * Add ``seconds`` to ``ts``
+ */
+static void timespec_add(struct timespec *ts, double seconds)
+{
+	long long nsec = ts->tv_nsec + (long long)((seconds - (time_t)seconds) * 1e9);
+	ts->tv_sec += (time_t)seconds + nsec / 1000000000;
+	ts->tv_nsec = nsec % 1000000000;
+}
+
+/*
+ * Return whether ``a`` is earlier than or equal to ``b``
+ */
+static bool timespec_le(const struct timespec *a, const struct timespec *b)
+{
+	return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec <= b->tv_nsec);
+}
+
+/*
+ * Move ``next`` forward by whole multiples of ``seconds`` until it is after
+ * ``now``, skipping any runs which were missed
+ */
+static void timespec_advance(struct timespec *next, const struct timespec *now, double seconds)
+{
+	if (!timespec_le(next, now))
+		return;
+
+	long long interval = (long long)(seconds * 1e9);
+	long long behind = (long long)(now->tv_sec - next->tv_sec) * 1000000000 + (now->tv_nsec - next->tv_nsec);
+	long long advance = (behind / interval + 1) * interval;
+
+	long long nsec = next->tv_nsec + advance % 1000000000;
+	next->tv_sec += advance / 1000000000 + nsec / 1000000000;
+	next->tv_nsec = nsec % 1000000000;
+}
+
+/*
+ * Return the number of seconds from ``start`` to ``end``
+ */
+static double timespec_diff(const struct timespec *start, const struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/*
+ * Work out the name a periodic task is registered under from its function,
+ * so that re-registering it when the script is reloaded replaces it.
+ * Returns an xmalloc'd string or NULL with a Python error set.
+ */
+static char* periodic_task_name(PyObject *func)
+{
+	if (PyUnicode_Check(func))
+		return xstrdup(PyUnicode_AsUTF8(func));
+
+	PyObject* module = PyObject_GetAttrString(func, "__module__");
+	PyObject* qualname = PyObject_GetAttrString(func, "__qualname__");
+	char *name = NULL;
+
+	if (module && qualname)
+	{
+		PyObject* module_str = PyObject_Str(module);
+		PyObject* qualname_str = PyObject_Str(qualname);
+		if (module_str && qualname_str)
+			name = xstrdup_printf("%s.%s", PyUnicode_AsUTF8(module_str), PyUnicode_AsUTF8(qualname_str));
+		Py_XDECREF(module_str);
+		Py_XDECREF(qualname_str);
+	}
+	Py_XDECREF(module);
+	Py_XDECREF(qualname);
+
+	return name;
+}
+
+/*
+ * Return the name of the module defining ``func``, or NULL if it has none
+ */
+static char* periodic_task_module(PyObject *func)
+{
+	PyObject* module = PyObject_GetAttrString(func, "__module__");
+	char *name = NULL;
+
+	if (module && PyUnicode_Check(module))
+		name = xstrdup(PyUnicode_AsUTF8(module));
+	Py_XDECREF(module);
+	PyErr_Clear();
+
+	return name;
+}
+
+/*
+ * Return the index of the task called ``name``, or -1. Must be called with
+ * ``task_lock`` held.
+ */
+static int find_periodic_task(const char *name)
+{
+	for (int i = 0; i < task_count; ++i)
+	{
+		if (strcmp(tasks[i].name, name) == 0)
+			return i;
+	}
+	return -1;
+}
+
+/*
+ * Function to register into Python namespace to allow the plugin writer to
+ * run a function every ``seconds`` seconds in the background
+ */
+static PyObject* slurm_every(PyObject *self, PyObject *args)
+{
+	double seconds;
+	PyObject* func;
+
+	if (!PyArg_ParseTuple(args, "dO", &seconds, &func))
+		return NULL;
+	if (!isfinite(seconds) || seconds < PERIODIC_TASK_MIN_INTERVAL)
+	{
+		PyErr_SetString(PyExc_ValueError, "interval must be a finite number of at least 0.001 seconds");
+		return NULL;
+	}
+	if (!PyCallable_Check(func))
+	{
+		PyErr_SetString(PyExc_TypeError, "periodic task must be callable");
+		return NULL;
+	}
+
+	char *name = periodic_task_name(func);
+	if (name == NULL)
+		return NULL;
+
+	char *module = periodic_task_module(func);
+	PyObject* old_func = NULL;
+	Py_INCREF(func);
+
+	slurm_mutex_lock(&task_lock);
+	int i = find_periodic_task(name);
+	if (i >= 0)
+	{
+		// Already registered by an earlier load of the script
+		old_func = tasks[i].func;
+		tasks[i].func = func;
+		tasks[i].interval = seconds;
+		if (task_load_generation)
+			tasks[i].generation = task_load_generation;
+	}
+	else
+	{
+		tasks = xrealloc(tasks, sizeof(struct periodic_task) * (task_count + 1));
+		struct periodic_task *task = &tasks[task_count++];
+		memset(task, 0, sizeof(struct periodic_task));
+		task->name = xstrdup(name);
+		task->module = module;
+		module = NULL;
+		task->generation = task_load_generation;
+		task->func = func;
+		task->interval = seconds;
+		clock_gettime(CLOCK_MONOTONIC, &task->next_run);
+		pthread_cond_signal(&task_cond);
+	}
+	slurm_mutex_unlock(&task_lock);
+
+	Py_XDECREF(old_func);
+	xfree(module);
+
+	PyObject* p_name = PyUnicode_FromString(name);
+	xfree(name);
+	return p_name;
+}
+
+/*
+ * Function to register into Python namespace to allow the plugin writer to
+ * fetch the value most recently returned by a periodic task
+ */
+static PyObject* slurm_result(PyObject *self, PyObject *arg)
+{
+	char *name = periodic_task_name(arg);
+	if (name == NULL)
+		return NULL;
+
+	PyObject* result = NULL;
+
+	slurm_mutex_lock(&task_lock);
+	int i = find_periodic_task(name);
+	if (i >= 0)
+	{
+		result = tasks[i].result;
+		Py_XINCREF(result);
+	}
+	slurm_mutex_unlock(&task_lock);
+	xfree(name);
+
+	if (result == NULL)
+		Py_RETURN_NONE;
+	return result;
+}
+
+/*
+ * Return a dict of statistics about the periodic tasks
+ */
+static PyObject* periodic_task_stats()
+{
+	PyObject* dict = PyDict_New();
+
+	slurm_mutex_lock(&task_lock);
+	for (int i = 0; i < task_count; ++i)
+	{
+		struct periodic_task *task = &tasks[i];
+		PyObject* last_success = task->last_success ? PyLong_FromLong(task->last_success) : (Py_INCREF(Py_None), Py_None);
+		PyObject* entry = Py_BuildValue("{s:d,s:K,s:K,s:d,s:N}",
+						"interval", task->interval,
+						"runs", (unsigned long long)task->runs,
+						"failures", (unsigned long long)task->failures,
+						"last_duration", task->last_duration,
+						"last_success", last_success);
+		PyDict_SetItemString(dict, task->name, entry);
+		Py_DECREF(entry);
+	}
+	slurm_mutex_unlock(&task_lock);
+
+	return dict;
+}
+
+/*
+ * Run the periodic task called ``name`` and publish its result. The task may
+ * have been dropped by a reload of its module before or during the run.
+ */
+static void run_periodic_task(const char *name)
+{
+	PyGILState_STATE gstate = PyGILState_Ensure();
+
+	slurm_mutex_lock(&task_lock);
+	int i = find_periodic_task(name);
+	PyObject* func = i >= 0 ? tasks[i].func : NULL;
+	Py_XINCREF(func);
+	slurm_mutex_unlock(&task_lock);
+
+	if (func == NULL)
+	{
+		PyGILState_Release(gstate);
+		return;
+	}
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	PyObject* result = PyObject_CallObject(func, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	Py_DECREF(func);
+
+	PyObject* old_result = NULL;
+
+	slurm_mutex_lock(&task_lock);
+	i = find_periodic_task(name);
+	if (i < 0)
+	{
+		old_result = result;
+	}
+	else
+	{
+		tasks[i].runs++;
+		tasks[i].last_duration = timespec_diff(&start, &end);
+		if (result != NULL)
+		{
+			old_result = tasks[i].result;
+			tasks[i].result = result;
+			tasks[i].last_success = time(NULL);
+		}
+		else
+		{
+			tasks[i].failures++;
+		}
+	}
+	slurm_mutex_unlock(&task_lock);
+
+	Py_XDECREF(old_result);
+
+	if (result == NULL)
+	{
+		// Keep the previous result; the task will be retried at its next run
+		error("job_submit_python: Periodic task %s failed", name);
+		print_python_error();
+	}
+
+	PyGILState_Release(gstate);
+}
+
+/*
+ * The periodic task thread. Each task's next run is scheduled from its
+ * previous deadline rather than from when it finished so that the runs do not
+ * drift, and any runs missed while a task was overrunning are skipped.
+ */
+static void* periodic_task_thread(void *arg)
+{
+	slurm_mutex_lock(&task_lock);
+	while (!task_thread_shutdown)
+	{
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		int due = -1;
+		struct timespec wake = now;
+		wake.tv_sec += 3600;
+		for (int i = 0; i < task_count; ++i)
+		{
+			if (timespec_le(&tasks[i].next_run, &now))
+			{
+				due = i;
+				break;
+			}
+			if (timespec_le(&tasks[i].next_run, &wake))
+				wake = tasks[i].next_run;
+		}
+
+		if (due < 0)
+		{
+			pthread_cond_timedwait(&task_cond, &task_lock, &wake);
+			continue;
+		}
+
+		timespec_advance(&tasks[due].next_run, &now, tasks[due].interval);
+		char *name = xstrdup(tasks[due].name);
+
+		slurm_mutex_unlock(&task_lock);
+		run_periodic_task(name);
+		xfree(name);
+		slurm_mutex_lock(&task_lock);
+	}
+	slurm_mutex_unlock(&task_lock);
+
+	return NULL;
+}
+
+/*
+ * Start the periodic task thread
+ */
+static void start_periodic_tasks()
+{
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&task_cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	task_thread_shutdown = false;
+	if (pthread_create(&task_thread, NULL, periodic_task_thread, NULL) != 0)
+		error("job_submit_python: Could not start periodic task thread");
+}
+
+/*
+ * Stop the periodic task thread and release the tasks. The thread must be
+ * stopped before the GIL is taken to avoid deadlocking with a running task.
+ */
+static void stop_periodic_tasks()
+{
+	slurm_mutex_lock(&task_lock);
+	task_thread_shutdown = true;
+	pthread_cond_broadcast(&task_cond);
+	slurm_mutex_unlock(&task_lock);
+
+	pthread_join(task_thread, NULL);
+	pthread_cond_destroy(&task_cond);
+}
+
+/*
+ * Drop the references held by the periodic tasks. Must be called with the GIL.
+ */
+static void clear_periodic_tasks()
+{
+	for (int i = 0; i < task_count; ++i)
+	{
+		xfree(tasks[i].name);
+		xfree(tasks[i].module);
+		Py_XDECREF(tasks[i].func);
+		Py_XDECREF(tasks[i].result);
+	}
+	xfree(tasks);
+	task_count = 0;
+}
+
+/*
+ * Remove the task at index ``i``, returning the references it held in
+ * ``dropped`` to be released once ``task_lock`` is released
+ */
+static void remove_periodic_task(int i, PyObject **dropped)
+{
+	struct periodic_task *task = &tasks[i];
+	dropped[0] = task->func;
+	dropped[1] = task->result;
+	xfree(task->name);
+	xfree(task->module);
+	memmove(task, task + 1, sizeof(struct periodic_task) * (task_count - i - 1));
+	task_count--;
+}
+
+/*
+ * Begin a load of a module, so that the tasks it registers can be told apart
+ * from those registered by earlier loads
+ */
+static uint64_t periodic_task_load_begin(void)
+{
+	task_load_generation = __atomic_add_fetch(&task_generation, 1, __ATOMIC_RELAXED);
+	return task_load_generation;
+}
+
+/*
+ * Finish loading ``module``. If the load succeeded, the tasks which an earlier
+ * load of the module registered but this one did not are dropped, so that a
+ * task removed from the script stops running. Must be called with the GIL.
+ */
+static void periodic_task_load_end(const char *module, uint64_t generation, bool loaded)
+{
+	PyObject **dropped = NULL;
+	int dropped_count = 0;
+
+	task_load_generation = 0;
+	if (!loaded)
+		return;
+
+	slurm_mutex_lock(&task_lock);
+	for (int i = 0; i < task_count; )
+	{
+		struct periodic_task *task = &tasks[i];
+		if (task->module == NULL || strcmp(task->module, module) != 0 ||
+		    task->generation == 0 || task->generation >= generation)
+		{
+			++i;
+			continue;
+		}
+
+		verbose("job_submit_python: Periodic task %s is no longer registered, dropping it", task->name);
+		xrealloc(dropped, sizeof(PyObject*) * (dropped_count + 2));
+		remove_periodic_task(i, &dropped[dropped_count]);
+		dropped_count += 2;
+	}
+	slurm_mutex_unlock(&task_lock);
+
+	for (int i = 0; i < dropped_count; ++i)
+		Py_XDECREF(dropped[i]);
+	xfree(dropped);
+}
+
+/*
+ * Function to register into Python namespace to allow the plugin writer to
+ * stop a periodic task, returning whether it was registered
+ */
+static PyObject* slurm_cancel(PyObject *self, PyObject *arg)
+{
+	char *name = periodic_task_name(arg);
+	if (name == NULL)
+		return NULL;
+
+	PyObject* dropped[2] = {NULL, NULL};
+
+	slurm_mutex_lock(&task_lock);
+	int i = find_periodic_task(name);
+	if (i >= 0)
+		remove_periodic_task(i, dropped);
+	slurm_mutex_unlock(&task_lock);
+	xfree(name);
+
+	Py_XDECREF(dropped[0]);
+	Py_XDECREF(dropped[1]);
+
+	if (i < 0)
+		Py_RETURN_FALSE;
+	Py_RETURN_TRUE;
+}
+
+/*
+ * When ``TraceFile`` is set, a sample of ``job_submit()`` calls record the
+ * time spent in each stage, along with any ``slurm.span()`` in the script,
+ * into a buffer owned by the calling thread. Finished calls are pushed onto a
+ * lock-free list which a writer thread empties into a Chrome trace (JSON
+ * array) file that can be opened directly in Perfetto.
+ */
+#define TRACE_MAX_SPANS 64
+#define TRACE_NAME_LEN 48
+#define TRACE_FLUSH_INTERVAL 1
+
+struct trace_span {
+	char name[TRACE_NAME_LEN];
+	uint64_t start;
+	uint64_t end;
+};
+
+struct trace_call {
+	struct trace_call *next;
+	pid_t tid;
+	uint32_t submit_uid;
+	int rc;
+	int errors;
+	int span_count;
+	struct trace_span spans[TRACE_MAX_SPANS];
+};
+
+static __thread struct trace_call *trace_current = NULL;
+static struct trace_call *trace_pending = NULL;
+static uint32_t trace_counter = 0;
+
+static FILE *trace_fp = NULL;
+static pthread_mutex_t trace_writer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t trace_writer_cond;
+static pthread_t trace_writer_thread;
+static bool trace_writer_shutdown = false;
+
+/*
+ * Return the monotonic clock in nanoseconds
+ */
+static uint64_t monotonic_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Open a span called ``name`` in the current call's trace, returning its
+ * index or -1 if this call is not being traced
+ */
+static int trace_span_begin(const char *name)
+{
+	struct trace_call *call = trace_current;
+
+	if (call == NULL || call->span_count >= TRACE_MAX_SPANS)
+		return -1;
+
+	struct trace_span *span = &call->spans[call->span_count];
+	snprintf(span->name, TRACE_NAME_LEN, "%s", name);
+	span->start = monotonic_ns();
+	span->end = 0;
+
+	return call->span_count++;
+}
+
+/*
+ * Close the span at ``index`` opened with ``trace_span_begin()``
+ */
+static void trace_span_end(int index)
+{
+	if (trace_current == NULL || index < 0)
+		return;
+
+	trace_current->spans[index].end = monotonic_ns();
+}
+
+/*
+ * Decide whether to trace this call and, if so, start recording it. The
+ * first span covers the whole call.
+ */
+static void trace_begin(uint32_t submit_uid)
+{
+	if (conf.trace_file == NULL)
+		return;
+	if (__atomic_fetch_add(&trace_counter, 1, __ATOMIC_RELAXED) % conf.trace_sample != 0)
+		return;
+
+	trace_current = xmalloc(sizeof(struct trace_call));
+	trace_current->tid = (pid_t)syscall(SYS_gettid);
+	trace_current->submit_uid = submit_uid;
+	trace_span_begin("job_submit");
+}
+
+/*
+ * Finish recording this call and hand it to the writer thread if it was
+ * slow enough to be kept
+ */
+static void trace_end(int rc, int errors)
+{
+	struct trace_call *call = trace_current;
+
+	if (call == NULL)
+		return;
+	trace_current = NULL;
+
+	call->rc = rc;
+	call->errors = errors;
+	call->spans[0].end = monotonic_ns();
+
+	if (call->spans[0].end - call->spans[0].start < (uint64_t)conf.trace_min_duration * 1000000)
+	{
+		xfree(call);
+		return;
+	}
+
+	call->next = __atomic_load_n(&trace_pending, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&trace_pending, &call->next, call, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+}
+
+/*
+ * Write ``str`` to ``fp`` as the contents of a JSON string
+ */
+static void fputs_json(const char *str, FILE *fp)
+{
+	for (; *str; ++str)
+	{
+		if (*str == '"' || *str == '\\')
+			fprintf(fp, "\\%c", *str);
+		else if ((unsigned char)*str < 0x20)
+			fprintf(fp, "\\u%04x", *str);
+		else
+			fputc(*str, fp);
+	}
+}
+
+/*
+ * Open the trace file, starting a new JSON array if it is empty
+ */
+static void trace_file_open(void)
+{
+	trace_fp = fopen(conf.trace_file, "a");
+	if (trace_fp == NULL)
+	{
+		error("job_submit_python: Could not open trace file %s: %m", conf.trace_file);
+		return;
+	}
+	if (ftell(trace_fp) == 0)
+		fputs("[\n", trace_fp);
+}
+
+/*
+ * Write a traced call to the trace file as complete ("X") events
+ */
+static void trace_write_call(struct trace_call *call)
+{
+	pid_t pid = getpid();
+
+	for (int i = 0; i < call->span_count; ++i)
+	{
+		struct trace_span *span = &call->spans[i];
+		if (span->end == 0)
+			continue;
+
+		fputs("{\"name\":\"", trace_fp);
+		fputs_json(span->name, trace_fp);
+		fprintf(trace_fp, "\",\"cat\":\"job_submit\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d",
+			span->start / 1e3, (span->end - span->start) / 1e3, (int)pid, (int)call->tid);
+		if (i == 0)
+			fprintf(trace_fp, ",\"args\":{\"submit_uid\":%u,\"rc\":%d,\"errors\":%d}", call->submit_uid, call->rc, call->errors);
+		fputs("},\n", trace_fp);
+	}
+}
+
+/*
+ * Write out every call finished since the last flush, rotating the trace
+ * file once it grows past ``TraceMaxSize``
+ */
+static void trace_flush(void)
+{
+	struct trace_call *calls = __atomic_exchange_n(&trace_pending, NULL, __ATOMIC_ACQUIRE);
+
+	// The list is newest first so reverse it to write the calls in order
+	struct trace_call *ordered = NULL;
+	while (calls)
+	{
+		struct trace_call *next = calls->next;
+		calls->next = ordered;
+		ordered = calls;
+		calls = next;
+	}
+
+	if (ordered && trace_fp == NULL)
+		trace_file_open();
+
+	while (ordered)
+	{
+		struct trace_call *next = ordered->next;
+		if (trace_fp)
+			trace_write_call(ordered);
+		xfree(ordered);
+		ordered = next;
+	}
+
+	if (trace_fp == NULL)
+		return;
+
+	fflush(trace_fp);
+	if (ftell(trace_fp) >= (long)conf.trace_max_size * 1024 * 1024)
+	{
+		char *rotated = xstrdup_printf("%s.1", conf.trace_file);
+		fclose(trace_fp);
+		trace_fp = NULL;
+		if (rename(conf.trace_file, rotated) != 0)
+			error("job_submit_python: Could not rotate trace file %s: %m", conf.trace_file);
+		xfree(rotated);
+	}
+}
+
+/*
+ * The trace writer thread
+ */
+static void* trace_writer_main(void *arg)
+{
+	slurm_mutex_lock(&trace_writer_lock);
+	while (!trace_writer_shutdown)
+	{
+		struct timespec wake;
+		clock_gettime(CLOCK_MONOTONIC, &wake);
+		wake.tv_sec += TRACE_FLUSH_INTERVAL;
+		pthread_cond_timedwait(&trace_writer_cond, &trace_writer_lock, &wake);
+
+		trace_flush();
+	}
+	slurm_mutex_unlock(&trace_writer_lock);
+
+	return NULL;
+}
+
+/*
+ * Start the trace writer thread if tracing is enabled
+ */
+static void start_trace_writer()
+{
+	if (conf.trace_file == NULL)
+		return;
+
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&trace_writer_cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	trace_writer_shutdown = false;
+	if (pthread_create(&trace_writer_thread, NULL, trace_writer_main, NULL) != 0)
+		error("job_submit_python: Could not start trace writer thread");
+}
+
+/*
+ * Stop the trace writer thread, writing out anything still pending
+ */
+static void stop_trace_writer()
+{
+	if (conf.trace_file == NULL)
+		return;
+
+	slurm_mutex_lock(&trace_writer_lock);
+	trace_writer_shutdown = true;
+	pthread_cond_broadcast(&trace_writer_cond);
+	slurm_mutex_unlock(&trace_writer_lock);
+
+	pthread_join(trace_writer_thread, NULL);
+	pthread_cond_destroy(&trace_writer_cond);
+
+	trace_flush();
+	if (trace_fp)
+		fclose(trace_fp);
+	trace_fp = NULL;
+}
+
+/*
+ * When ``ProfileInterval`` is set, a sampler thread records the Python stack
+ * of the script every ``ProfileInterval`` milliseconds while its
+ * ``job_submit`` function is running. Between calls the sampler sleeps on
+ * ``profile_cond`` so it costs nothing. Samples are aggregated into
+ * collapsed-stack counts which can be fed straight to flamegraph.pl.
+ */
+#define PROFILE_MAX_DEPTH 128
+#define PROFILE_MAX_TARGETS 64
+
+static PyThreadState *profile_targets[PROFILE_MAX_TARGETS];
+static int profile_target_count = 0;
+static PyObject *profile_counts = NULL;
+static uint64_t profile_samples = 0;
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t profile_cond;
+static pthread_t profile_thread;
+static bool profile_shutdown = false;
+
+/*
+ * Frame access helpers returning new references, which work both before and
+ * after frame objects became opaque in Python 3.9
+ */
+static PyFrameObject* frame_get_current(PyThreadState *tstate)
+{
+#if PY_VERSION_HEX >= 0x03090000
+	return PyThreadState_GetFrame(tstate);
+#else
+	Py_XINCREF(tstate->frame);
+	return tstate->frame;
+#endif
+}
+
+static PyFrameObject* frame_get_back(PyFrameObject *frame)
+{
+#if PY_VERSION_HEX >= 0x03090000
+	return PyFrame_GetBack(frame);
+#else
+	Py_XINCREF(frame->f_back);
+	return frame->f_back;
+#endif
+}
+
+static PyObject* frame_get_code(PyFrameObject *frame)
+{
+#if PY_VERSION_HEX >= 0x03090000
+	return (PyObject*)PyFrame_GetCode(frame);
+#else
+	Py_INCREF(frame->f_code);
+	return (PyObject*)frame->f_code;
+#endif
+}
+
+/*
+ * Describe a frame as ``file:function`` for the collapsed stack
+ */
+static PyObject* frame_label(PyFrameObject *frame)
+{
+	PyObject* code = frame_get_code(frame);
+	PyObject* filename = PyObject_GetAttrString(code, "co_filename");
+	PyObject* name = PyObject_GetAttrString(code, "co_name");
+	Py_DECREF(code);
+
+	PyObject* label = NULL;
+	if (filename && name)
+	{
+		const char *file = PyUnicode_AsUTF8(filename);
+		const char *slash = file ? strrchr(file, '/') : NULL;
+		label = PyUnicode_FromFormat("%s:%U", slash ? slash + 1 : file, name);
+	}
+	Py_XDECREF(filename);
+	Py_XDECREF(name);
+
+	return label;
+}
+
+/*
+ * Record the current stack of ``tstate``. Must be called with the GIL.
+ */
+static void profile_sample(PyThreadState *tstate)
+{
+	PyObject* labels[PROFILE_MAX_DEPTH];
+	int depth = 0;
+
+	PyFrameObject *frame = frame_get_current(tstate);
+	while (frame && depth < PROFILE_MAX_DEPTH)
+	{
+		PyObject* label = frame_label(frame);
+		if (label)
+			labels[depth++] = label;
+
+		PyFrameObject *back = frame_get_back(frame);
+		Py_DECREF(frame);
+		frame = back;
+	}
+	Py_XDECREF(frame);
+
+	if (depth == 0)
+		return;
+
+	// Collapsed stacks run from the outermost frame to the innermost
+	PyObject* stack = PyUnicode_FromString("");
+	for (int i = depth - 1; i >= 0; --i)
+	{
+		PyObject* joined = PyUnicode_FromFormat(i == depth - 1 ? "%U%U" : "%U;%U", stack, labels[i]);
+		Py_DECREF(stack);
+		Py_DECREF(labels[i]);
+		stack = joined;
+	}
+
+	PyObject* count = PyDict_GetItem(profile_counts, stack);
+	PyObject* new_count = PyLong_FromLong(count ? PyLong_AsLong(count) + 1 : 1);
+	PyDict_SetItem(profile_counts, stack, new_count);
+	Py_DECREF(new_count);
+	Py_DECREF(stack);
+
+	profile_samples++;
+	PyErr_Clear();
+}
+
+/*
+ * Return the collapsed-stack counts as a string. Must be called with the GIL.
+ */
+static PyObject* profile_collapsed(void)
+{
+	PyObject* lines = PyList_New(0);
+	PyObject *stack, *count;
+	Py_ssize_t pos = 0;
+
+	if (profile_counts)
+	{
+		while (PyDict_Next(profile_counts, &pos, &stack, &count))
+		{
+			PyObject* line = PyUnicode_FromFormat("%U %S\n", stack, count);
+			PyList_Append(lines, line);
+			Py_DECREF(line);
+		}
+	}
+
+	PyObject* empty = PyUnicode_FromString("");
+	PyObject* result = PyUnicode_Join(empty, lines);
+	Py_DECREF(empty);
+	Py_DECREF(lines);
+
+	return result;
+}
+
+/*
+ * Write the collapsed-stack counts to ``ProfileFile``, replacing it
+ */
+static void profile_write_file(void)
+{
+	PyGILState_STATE gstate = PyGILState_Ensure();
+	PyObject* collapsed = profile_collapsed();
+	const char *text = collapsed ? PyUnicode_AsUTF8(collapsed) : NULL;
+
+	char *tmp_path = xstrdup_printf("%s.tmp", conf.profile_file);
+	FILE *fp = text ? fopen(tmp_path, "w") : NULL;
+	if (fp)
+	{
+		fputs(text, fp);
+		fclose(fp);
+		if (rename(tmp_path, conf.profile_file) != 0)
+			error("job_submit_python: Could not write profile to %s: %m", conf.profile_file);
+	}
+	else
+	{
+		error("job_submit_python: Could not write profile to %s", tmp_path);
+	}
+	xfree(tmp_path);
+
+	Py_XDECREF(collapsed);
+	PyErr_Clear();
+	PyGILState_Release(gstate);
+}
+
+/*
+ * Start sampling the current thread, which is about to call the script
+ */
+static void profile_start(void)
+{
+	if (conf.profile_interval == 0)
+		return;
+
+	slurm_mutex_lock(&profile_lock);
+	if (profile_target_count < PROFILE_MAX_TARGETS)
+		profile_targets[profile_target_count++] = PyThreadState_Get();
+	pthread_cond_signal(&profile_cond);
+	slurm_mutex_unlock(&profile_lock);
+}
+
+/*
+ * Stop sampling once the script has returned
+ */
+static void profile_stop(void)
+{
+	if (conf.profile_interval == 0)
+		return;
+
+	PyThreadState *tstate = PyThreadState_Get();
+
+	slurm_mutex_lock(&profile_lock);
+	for (int i = 0; i < profile_target_count; ++i)
+	{
+		if (profile_targets[i] == tstate)
+		{
+			profile_targets[i] = profile_targets[--profile_target_count];
+			break;
+		}
+	}
+	slurm_mutex_unlock(&profile_lock);
+}
+
+/*
+ * The sampler thread. Ticks stay on a fixed grid across calls, but the thread
+ * only wakes up for ticks which fall while a call is in progress. At each tick
+ * it takes the GIL to read the callers' stacks; as a caller holds the GIL
+ * between ``profile_start()`` and ``profile_stop()``, any thread state in
+ * ``profile_targets`` while the GIL is held is still inside the script. It
+ * also writes ``ProfileFile`` every ``ProfileDumpInterval`` seconds.
+ */
+static void* profile_thread_main(void *arg)
+{
+	struct timespec next_tick, next_dump;
+	clock_gettime(CLOCK_MONOTONIC, &next_tick);
+	next_dump = next_tick;
+	timespec_add(&next_dump, conf.profile_dump_interval);
+	bool dumps = conf.profile_file && conf.profile_dump_interval;
+
+	slurm_mutex_lock(&profile_lock);
+	while (!profile_shutdown)
+	{
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		if (profile_target_count == 0)
+		{
+			if (dumps && timespec_le(&next_dump, &now))
+			{
+				timespec_advance(&next_dump, &now, conf.profile_dump_interval);
+				slurm_mutex_unlock(&profile_lock);
+				profile_write_file();
+				slurm_mutex_lock(&profile_lock);
+				continue;
+			}
+
+			struct timespec wake = next_dump;
+			if (!dumps)
+				wake.tv_sec = now.tv_sec + 3600;
+			pthread_cond_timedwait(&profile_cond, &profile_lock, &wake);
+			continue;
+		}
+
+		if (!timespec_le(&next_tick, &now))
+		{
+			pthread_cond_timedwait(&profile_cond, &profile_lock, &next_tick);
+			continue;
+		}
+		// Ticks missed while no call was sampled are skipped, not caught up
+		timespec_advance(&next_tick, &now, conf.profile_interval / 1e3);
+		slurm_mutex_unlock(&profile_lock);
+
+		PyGILState_STATE gstate = PyGILState_Ensure();
+		slurm_mutex_lock(&profile_lock);
+		int target_count = profile_target_count;
+		PyThreadState *targets[PROFILE_MAX_TARGETS];
+		memcpy(targets, profile_targets, sizeof(PyThreadState*) * target_count);
+		slurm_mutex_unlock(&profile_lock);
+		for (int i = 0; i < target_count; ++i)
+			profile_sample(targets[i]);
+		PyGILState_Release(gstate);
+
+		slurm_mutex_lock(&profile_lock);
+	}
+	slurm_mutex_unlock(&profile_lock);
+
+	return NULL;
+}
+
+/*
+ * Start the sampler thread if profiling is enabled. Must be called with the
+ * GIL.
+ */
+static void start_profiler()
+{
+	if (conf.profile_interval == 0)
+		return;
+
+#ifdef Py_GIL_DISABLED
+	// Other threads' stacks cannot be read safely without the GIL
+	error("job_submit_python: ProfileInterval is not supported with free-threaded Python");
+	conf.profile_interval = 0;
+	return;
+#endif
+
+	profile_counts = PyDict_New();
+
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&profile_cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	profile_shutdown = false;
+	if (pthread_create(&profile_thread, NULL, profile_thread_main, NULL) != 0)
+		error("job_submit_python: Could not start profiler thread");
+}
+
+/*
+ * Stop the sampler thread. The thread must be stopped before the GIL is
+ * taken to avoid deadlocking with a sample in progress.
+ */
+static void stop_profiler()
+{
+	if (conf.profile_interval == 0)
+		return;
+
+	slurm_mutex_lock(&profile_lock);
+	profile_shutdown = true;
+	pthread_cond_broadcast(&profile_cond);
+	slurm_mutex_unlock(&profile_lock);
+
+	pthread_join(profile_thread, NULL);
+	pthread_cond_destroy(&profile_cond);
+}
+
+/*
+ * Write out and release the profile. Must be called with the GIL.
+ */
+static void clear_profiler()
+{
+	if (conf.profile_interval == 0)
+		return;
+
+	if (conf.profile_file)
+	{
+		// profile_write_file() takes the GIL itself
+		PyThreadState *tstate = PyEval_SaveThread();
+		profile_write_file();
+		PyEval_RestoreThread(tstate);
+	}
+	Py_CLEAR(profile_counts);
+}
+
+/*
+ * Function to register into Python namespace to allow the plugin writer to
+ * fetch the profile as collapsed stacks for flamegraph.pl
+ */
+static PyObject* slurm_profile_dump(PyObject *self, PyObject *args)
+{
+	return profile_collapsed();
+}
+
+/*
+ * ``slurm.user()`` and ``slurm.groups()`` are backed by a cache of user and
+ * group lookups, split into shards each with their own lock. Failed lookups
+ * are cached too, for ``IdentityNegativeTTL`` seconds. Once an entry is older
+ * than its TTL it is still returned, and a refresh is queued for the
+ * identity thread, so only the very first lookup of a user blocks the
+ * submission. Entries are never modified once published; a refresh replaces
+ * the whole entry and readers hold a reference to the one they are using.
+ */
+#define IDENTITY_SHARDS 16
+#define IDENTITY_BUCKETS 64
+
+struct identity_entry {
+	struct identity_entry *next;
+	int refs;
+	uid_t uid;
+	bool found;
+	char *name;
+	gid_t gid;
+	char *gecos;
+	char *home;
+	char *shell;
+	int group_count;
+	char **groups;
+	time_t expires;
+	bool refreshing;
+};
+
+struct identity_shard {
+	pthread_mutex_t lock;
+	struct identity_entry *buckets[IDENTITY_BUCKETS];
+	uint64_t hits;
+	uint64_t stale_hits;
+	uint64_t negative_hits;
+	uint64_t misses;
+	uint64_t refreshes;
+	uint64_t failures;
+	uint64_t entries;
+};
+
+static struct identity_shard identity_shards[IDENTITY_SHARDS];
+
+static uid_t *identity_queue = NULL;
+static int identity_queue_count = 0;
+static pthread_mutex_t identity_queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t identity_queue_cond;
+static pthread_t identity_thread;
+static bool identity_shutdown = false;
+
+/*
+ * Drop a reference to ``entry``, freeing it when it is no longer used
+ */
+static void identity_entry_release(struct identity_entry *entry)
+{
+	if (__atomic_sub_fetch(&entry->refs, 1, __ATOMIC_ACQ_REL) != 0)
+		return;
+
+	xfree(entry->name);
+	xfree(entry->gecos);
+	xfree(entry->home);
+	xfree(entry->shell);
+	for (int i = 0; i < entry->group_count; ++i)
+		xfree(entry->groups[i]);
+	xfree(entry->groups);
+	xfree(entry);
+}
+
+/*
+ * Look up the group name for ``gid``, falling back to the number
+ */
+static char* identity_group_name(gid_t gid)
+{
+	struct group grp, *result = NULL;
+	size_t buf_size = 4096;
+	char *buf = xmalloc(buf_size);
+	char *name;
+
+	while (getgrgid_r(gid, &grp, buf, buf_size, &result) == ERANGE)
+	{
+		buf_size *= 2;
+		xrealloc(buf, buf_size);
+	}
+
+	if (result)
+		name = xstrdup(grp.gr_name);
+	else
+		name = xstrdup_printf("%u", (unsigned)gid);
+	xfree(buf);
+
+	return name;
+}
+
+/*
+ * Look up ``uid`` in the system user and group databases. This may block on
+ * LDAP/SSSD so must not be called with any lock held. Returns NULL, with
+ * ``errno`` set, if the lookup failed.
+ */
+static struct identity_entry* identity_fetch(uid_t uid)
+{
+	struct passwd pwd, *result = NULL;
+	size_t buf_size = 4096;
+	char *buf = xmalloc(buf_size);
+	int rc;
+
+	while ((rc = getpwuid_r(uid, &pwd, buf, buf_size, &result)) == ERANGE)
+	{
+		buf_size *= 2;
+		xrealloc(buf, buf_size);
+	}
+
+	// Only a lookup which did not find the user is cached as "no such user";
+	// a directory outage must not hide real users. getpwuid(3) lists these
+	// as the codes some NSS modules (sss, ldap, ...) use for not found.
+	if (rc == ENOENT || rc == ESRCH || rc == EBADF || rc == EPERM)
+	{
+		result = NULL;
+	}
+	else if (rc != 0)
+	{
+		errno = rc;
+		error("job_submit_python: Could not look up user %u: %m", (unsigned int)uid);
+		xfree(buf);
+		errno = rc;
+		return NULL;
+	}
+
+	struct identity_entry *entry = xmalloc(sizeof(struct identity_entry));
+	entry->refs = 1;
+	entry->uid = uid;
+	entry->found = result != NULL;
+
+	if (entry->found)
+	{
+		entry->name = xstrdup(pwd.pw_name);
+		entry->gid = pwd.pw_gid;
+		entry->gecos = xstrdup(pwd.pw_gecos);
+		entry->home = xstrdup(pwd.pw_dir);
+		entry->shell = xstrdup(pwd.pw_shell);
+
+		gid_t *gids = NULL;
+#if SLURM_VERSION_NUMBER >= SLURM_VERSION_NUM(17,11,0)
+		// slurmctld's own cache of getgrouplist()
+		int ngids = group_cache_lookup(uid, pwd.pw_gid, pwd.pw_name, &gids);
+#else
+		int ngids = 64;
+		gids = xmalloc(sizeof(gid_t) * ngids);
+		if (getgrouplist(pwd.pw_name, pwd.pw_gid, gids, &ngids) < 0)
+		{
+			xrealloc(gids, sizeof(gid_t) * ngids);
+			getgrouplist(pwd.pw_name, pwd.pw_gid, gids, &ngids);
+		}
+#endif
+
+		entry->group_count = ngids > 0 ? ngids : 0;
+		entry->groups = xmalloc(sizeof(char*) * (entry->group_count + 1));
+		for (int i = 0; i < entry->group_count; ++i)
+			entry->groups[i] = identity_group_name(gids[i]);
+		xfree(gids);
+	}
+	xfree(buf);
+
+	entry->expires = time(NULL) + (entry->found ? conf.identity_ttl : conf.identity_negative_ttl);
+
+	return entry;
+}
+
+/*
+ * Publish ``entry`` in the cache, replacing any existing entry for its uid.
+ * The cache takes over the caller's reference.
+ */
+static void identity_store(struct identity_entry *entry)
+{
+	struct identity_shard *shard = &identity_shards[entry->uid % IDENTITY_SHARDS];
+	struct identity_entry **link = &shard->buckets[(entry->uid / IDENTITY_SHARDS) % IDENTITY_BUCKETS];
+	struct identity_entry *old = NULL;
+
+	slurm_mutex_lock(&shard->lock);
+	for (; *link; link = &(*link)->next)
+	{
+		if ((*link)->uid == entry->uid)
+		{
+			old = *link;
+			entry->next = old->next;
+			break;
+		}
+	}
+	*link = entry;
+	if (old == NULL)
+		shard->entries++;
+	slurm_mutex_unlock(&shard->lock);
+
+	if (old)
+		identity_entry_release(old);
+}
+
+/*
+ * Queue ``uid`` to be refreshed by the identity thread
+ */
+static void identity_queue_refresh(uid_t uid)
+{
+	slurm_mutex_lock(&identity_queue_lock);
+	xrealloc(identity_queue, sizeof(uid_t) * (identity_queue_count + 1));
+	identity_queue[identity_queue_count++] = uid;
+	pthread_cond_signal(&identity_queue_cond);
+	slurm_mutex_unlock(&identity_queue_lock);
+}
+
+/*
+ * Count a failed lookup of ``uid``. If it was a refresh then the stale entry
+ * is kept and will be refreshed again the next time it is used.
+ */
+static void identity_fetch_failed(uid_t uid, bool refresh)
+{
+	struct identity_shard *shard = &identity_shards[uid % IDENTITY_SHARDS];
+
+	slurm_mutex_lock(&shard->lock);
+	shard->failures++;
+	if (refresh)
+	{
+		struct identity_entry *entry = shard->buckets[(uid / IDENTITY_SHARDS) % IDENTITY_BUCKETS];
+		for (; entry; entry = entry->next)
+		{
+			if (entry->uid == uid)
+			{
+				entry->refreshing = false;
+				break;
+			}
+		}
+	}
+	slurm_mutex_unlock(&shard->lock);
+}
+
+/*
+ * Return a reference to the cache entry for ``uid``, looking it up if it is
+ * not cached. Must be called with the GIL, which is released while a missing
+ * entry is looked up. Returns NULL, with ``errno`` set, if it is not cached
+ * and the lookup failed.
+ */
+static struct identity_entry* identity_get(uid_t uid)
+{
+	struct identity_shard *shard = &identity_shards[uid % IDENTITY_SHARDS];
+	struct identity_entry *entry;
+	bool refresh = false;
+
+	slurm_mutex_lock(&shard->lock);
+	for (entry = shard->buckets[(uid / IDENTITY_SHARDS) % IDENTITY_BUCKETS]; entry; entry = entry->next)
+	{
+		if (entry->uid == uid)
+			break;
+	}
+	if (entry)
+	{
+		__atomic_add_fetch(&entry->refs, 1, __ATOMIC_RELAXED);
+		if (!entry->found)
+			shard->negative_hits++;
+		else
+			shard->hits++;
+		if (entry->expires <= time(NULL))
+		{
+			shard->stale_hits++;
+			if (!entry->refreshing)
+			{
+				entry->refreshing = true;
+				refresh = true;
+			}
+		}
+	}
+	else
+	{
+		shard->misses++;
+	}
+	slurm_mutex_unlock(&shard->lock);
+
+	if (refresh)
+		identity_queue_refresh(uid);
+	if (entry)
+		return entry;
+
+	int err = 0;
+	Py_BEGIN_ALLOW_THREADS
+	entry = identity_fetch(uid);
+	err = errno;
+	Py_END_ALLOW_THREADS
+
+	if (entry == NULL)
+	{
+		identity_fetch_failed(uid, false);
+		errno = err;
+		return NULL;
+	}
+
+	__atomic_add_fetch(&entry->refs, 1, __ATOMIC_RELAXED);
+	identity_store(entry);
+
+	return entry;
+}
+
+/*
+ * The identity thread, which refreshes stale cache entries
+ */
+static void* identity_thread_main(void *arg)
+{
+	slurm_mutex_lock(&identity_queue_lock);
+	while (!identity_shutdown)
+	{
+		if (identity_queue_count == 0)
+		{
+			slurm_cond_wait(&identity_queue_cond, &identity_queue_lock);
+			continue;
+		}
+
+		uid_t uid = identity_queue[--identity_queue_count];
+		slurm_mutex_unlock(&identity_queue_lock);
+
+		struct identity_entry *entry = identity_fetch(uid);
+		if (entry)
+		{
+			identity_store(entry);
+
+			struct identity_shard *shard = &identity_shards[uid % IDENTITY_SHARDS];
+			slurm_mutex_lock(&shard->lock);
+			shard->refreshes++;
+			slurm_mutex_unlock(&shard->lock);
+		}
+		else
+		{
+			identity_fetch_failed(uid, true);
+		}
+
+		slurm_mutex_lock(&identity_queue_lock);
+	}
+	slurm_mutex_unlock(&identity_queue_lock);
+
+	return NULL;
+}
+
+/*
+ * Start the identity thread
+ */
+static void start_identity_cache()
+{
+	for (int i = 0; i < IDENTITY_SHARDS; ++i)
+	{
+		memset(&identity_shards[i], 0, sizeof(struct identity_shard));
+		slurm_mutex_init(&identity_shards[i].lock);
+	}
+
+	pthread_cond_init(&identity_queue_cond, NULL);
+	identity_shutdown = false;
+	if (pthread_create(&identity_thread, NULL, identity_thread_main, NULL) != 0)
+		error("job_submit_python: Could not start identity cache thread");
+}
+
+/*
+ * Stop the identity thread and empty the cache
+ */
+static void stop_identity_cache()
+{
+	slurm_mutex_lock(&identity_queue_lock);
+	identity_shutdown = true;
+	pthread_cond_broadcast(&identity_queue_cond);
+	slurm_mutex_unlock(&identity_queue_lock);
+
+	pthread_join(identity_thread, NULL);
+	pthread_cond_destroy(&identity_queue_cond);
+	xfree(identity_queue);
+	identity_queue_count = 0;
+
+	for (int i = 0; i < IDENTITY_SHARDS; ++i)
+	{
+		for (int b = 0; b < IDENTITY_BUCKETS; ++b)
+		{
+			while (identity_shards[i].buckets[b])
+			{
+				struct identity_entry *entry = identity_shards[i].buckets[b];
+				identity_shards[i].buckets[b] = entry->next;
+				identity_entry_release(entry);
+			}
+		}
+		pthread_mutex_destroy(&identity_shards[i].lock);
+	}
+}
+
+/*
+ * Return a dict of statistics about the identity cache
+ */
+static PyObject* identity_cache_stats()
+{
+	uint64_t hits = 0, stale_hits = 0, negative_hits = 0, misses = 0, refreshes = 0, failures = 0, entries = 0;
+
+	for (int i = 0; i < IDENTITY_SHARDS; ++i)
+	{
+		struct identity_shard *shard = &identity_shards[i];
+		slurm_mutex_lock(&shard->lock);
+		hits += shard->hits;
+		stale_hits += shard->stale_hits;
+		negative_hits += shard->negative_hits;
+		misses += shard->misses;
+		refreshes += shard->refreshes;
+		failures += shard->failures;
+		entries += shard->entries;
+		slurm_mutex_unlock(&shard->lock);
+	}
+
+	uint64_t lookups = hits + negative_hits + misses;
+	return Py_BuildValue("{s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:d}",
+			     "hits", (unsigned long long)hits,
+			     "stale_hits", (unsigned long long)stale_hits,
+			     "negative_hits", (unsigned long long)negative_hits,
+			     "misses", (unsigned long long)misses,
+			     "refreshes", (unsigned long long)refreshes,
+			     "failures", (unsigned long long)failures,
+			     "entries", (unsigned long long)entries,
+			     "hit_rate", lookups ? (double)(hits + negative_hits) / lookups : 0.0);
+}
+
+/*
+ * Function to register into Python namespace to allow the plugin writer to
+ * look up a user, returning a dict of their details or None if there is no
+ * such user
+ */
+static PyObject* slurm_user(PyObject *self, PyObject *arg)
+{
+	unsigned long uid = PyLong_AsUnsignedLong(arg);
+	if (PyErr_Occurred())
+		return NULL;
+
+	struct identity_entry *entry = identity_get((uid_t)uid);
+	if (entry == NULL)
+		return PyErr_SetFromErrno(PyExc_OSError);
+	PyObject* result;
+
+	if (entry->found)
+		result = Py_BuildValue("{s:k,s:s,s:k,s:s,s:s,s:s}",
+				       "uid", (unsigned long)entry->uid,
+				       "name", entry->name,
+				       "gid", (unsigned long)entry->gid,
+				       "gecos", entry->gecos,
+				       "home", entry->home,
+				       "shell", entry->shell);
+	else
+		result = (Py_INCREF(Py_None), Py_None);
+
+	identity_entry_release(entry);
+	return result;
+}
+
+/*
+ * Function to register into Python namespace to allow the plugin writer to
+ * look up the names of the groups a user is in, or None if there is no such
+ * user
+ */
+static PyObject* slurm_groups(PyObject *self, PyObject *arg)
+{
+	unsigned long uid = PyLong_AsUnsignedLong(arg);
+	if (PyErr_Occurred())
+		return NULL;
+
+	struct identity_entry *entry = identity_get((uid_t)uid);
+	if (entry == NULL)
+		return PyErr_SetFromErrno(PyExc_OSError);
+	PyObject* result;
+
+	if (entry->found)
+		result = char_star_star_to_python(entry->group_count, entry->groups);
+	else
+		result = (Py_INCREF(Py_None), Py_None);
+
+	identity_entry_release(entry);
+	return result;
+}
+
+/*
+ * Shadow evaluation. When ``ShadowModule`` is set, a copy of the descriptor
+ * given to the live policy is queued along with the live policy's decision,
+ * and the shadow thread later runs the candidate module's ``job_submit()`` on
+ * the copy. The candidate's changes and messages are never applied; only its
+ * latency and how its decision differs from the live one are recorded. Jobs
+ * are dropped rather than queued if the shadow thread falls behind.
+ */
+#define SHADOW_QUEUE_SIZE 256
+#define LATENCY_BUCKETS 32
+
+struct shadow_job {
+	PyObject *input;	/* copy of the descriptor before the live policy ran */
+	PyObject *output;	/* copy of the descriptor after the live policy ran */
+	uint32_t submit_uid;
+	long rc;		/* the live policy's return code */
+};
+
+/*
+ * A log2 histogram of call latencies, where bucket ``i`` counts calls taking
+ * between 2^i and 2^(i+1) microseconds
+ */
+struct latency_histogram {
+	uint64_t buckets[LATENCY_BUCKETS];
+	uint64_t count;
+	uint64_t total_ns;
+	uint64_t max_ns;
+};
+
+static struct shadow_job shadow_queue[SHADOW_QUEUE_SIZE];
+static int shadow_queue_head = 0;
+static int shadow_queue_count = 0;
+static pthread_mutex_t shadow_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t shadow_cond;
+static pthread_t shadow_thread;
+static bool shadow_running = false;
+static bool shadow_shutdown = false;
+static uint32_t shadow_counter = 0;
+
+static struct latency_histogram shadow_live_latency;
+static struct latency_histogram shadow_candidate_latency;
+static uint64_t shadow_runs = 0;
+static uint64_t shadow_dropped = 0;
+static uint64_t shadow_errors = 0;
+static uint64_t shadow_identical = 0;
+static uint64_t shadow_rc_mismatches = 0;
+static PyObject *shadow_field_diffs = NULL;	/* field name to number of differences */
+
+/*
+ * Add a call taking ``ns`` nanoseconds to ``hist``. Live calls may be
+ * recorded from several threads at once so the counters are atomic.
+ */
+static void latency_record(struct latency_histogram *hist, uint64_t ns)
+{
+	uint64_t us = ns / 1000;
+	int bucket = us ? 63 - __builtin_clzll(us) : 0;
+	if (bucket >= LATENCY_BUCKETS)
+		bucket = LATENCY_BUCKETS - 1;
+
+	__atomic_fetch_add(&hist->buckets[bucket], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&hist->count, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&hist->total_ns, ns, __ATOMIC_RELAXED);
+
+	uint64_t max = __atomic_load_n(&hist->max_ns, __ATOMIC_RELAXED);
+	while (ns > max && !__atomic_compare_exchange_n(&hist->max_ns, &max, ns, false,
+							 __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+/*
+ * Return the upper bound in seconds of the bucket holding the ``q`` quantile
+ * of ``buckets``
+ */
+static double latency_quantile(const uint64_t *buckets, uint64_t count, double q)
+{
+	uint64_t target = (uint64_t)(q * count + 0.5);
+	uint64_t seen = 0;
+
+	for (int i = 0; i < LATENCY_BUCKETS; ++i)
+	{
+		seen += buckets[i];
+		if (seen >= target && seen > 0)
+			return (double)(2ULL << i) / 1e6;
+	}
+	return 0.0;
+}
+
+/*
+ * Return a dict describing the latency histogram ``hist``
+ */
+static PyObject* latency_stats(struct latency_histogram *hist)
+{
+	uint64_t buckets[LATENCY_BUCKETS];
+	uint64_t count = 0;
+
+	for (int i = 0; i < LATENCY_BUCKETS; ++i)
+	{
+		buckets[i] = __atomic_load_n(&hist->buckets[i], __ATOMIC_RELAXED);
+		count += buckets[i];
+	}
+
+	PyObject* py_buckets = PyList_New(LATENCY_BUCKETS);
+	if (py_buckets == NULL)
+		return NULL;
+	for (int i = 0; i < LATENCY_BUCKETS; ++i)
+		PyList_SET_ITEM(py_buckets, i, PyLong_FromUnsignedLongLong(buckets[i]));
+
+	uint64_t total_ns = __atomic_load_n(&hist->total_ns, __ATOMIC_RELAXED);
+	return Py_BuildValue("{s:K,s:d,s:d,s:d,s:d,s:d,s:N}",
+			     "count", (unsigned long long)count,
+			     "mean", count ? total_ns / 1e9 / count : 0.0,
+			     "p50", latency_quantile(buckets, count, 0.50),
+			     "p90", latency_quantile(buckets, count, 0.90),
+			     "p99", latency_quantile(buckets, count, 0.99),
+			     "max", __atomic_load_n(&hist->max_ns, __ATOMIC_RELAXED) / 1e9,
+			     "buckets", py_buckets);
+}
+
+/*
+ * Return true if this call should be shadowed
+ */
+static bool shadow_sampled(void)
+{
+	if (conf.shadow_module == NULL)
+		return false;
+	return __atomic_fetch_add(&shadow_counter, 1, __ATOMIC_RELAXED) % conf.shadow_sample == 0;
+}
+
+/*
+ * Copy the descriptor ``desc`` deeply enough that the live policy cannot
+ * change the copy, which is its attributes plus any dicts and lists in them.
+ * Returns NULL, without an exception set, if the copy could not be made.
+ */
+static PyObject* shadow_copy_descriptor(PyObject *desc)
+{
+	struct slurm_module_state *state = slurm_module_state();
+	PyObject *copy = NULL;
+
+	PyObject *attrs = PyObject_GetAttrString(desc, "__dict__");
+	PyObject *copied = attrs ? PyDict_Copy(attrs) : NULL;
+	PyObject *args = PyTuple_New(0);
+	Py_XDECREF(attrs);
+
+	if (state && copied && args)
+	{
+		PyObject *key, *value;
+		Py_ssize_t pos = 0;
+		bool ok = true;
+
+		while (ok && PyDict_Next(copied, &pos, &key, &value))
+		{
+			PyObject *inner = NULL;
+			if (PyDict_Check(value))
+				inner = PyDict_Copy(value);
+			else if (PyList_Check(value))
+				inner = PyList_GetSlice(value, 0, PyList_GET_SIZE(value));
+			else
+				continue;
+
+			// Replacing the value of an existing key is safe during iteration
+			ok = inner && PyDict_SetItem(copied, key, inner) == 0;
+			Py_XDECREF(inner);
+		}
+
+		if (ok)
+			copy = PyObject_Call(state->simple_namespace, args, copied);
+	}
+
+	Py_XDECREF(args);
+	Py_XDECREF(copied);
+	if (copy == NULL)
+		PyErr_Clear();
+	return copy;
+}
+
+/*
+ * Queue the candidate policy to be run on ``input``, where ``output`` and
+ * ``rc`` are the live policy's decision. Steals the references to ``input``
+ * and ``output``, either of which may be NULL if it could not be copied.
+ * Must be called with the GIL.
+ */
+static void shadow_submit(PyObject *input, PyObject *output, uint32_t submit_uid, long rc)
+{
+	if (input == NULL || output == NULL)
+	{
+		Py_XDECREF(input);
+		Py_XDECREF(output);
+		return;
+	}
+
+	slurm_mutex_lock(&shadow_lock);
+	if (shadow_running && shadow_queue_count < SHADOW_QUEUE_SIZE)
+	{
+		struct shadow_job *job = &shadow_queue[(shadow_queue_head + shadow_queue_count) % SHADOW_QUEUE_SIZE];
+		job->input = input;
+		job->output = output;
+		job->submit_uid = submit_uid;
+		job->rc = rc;
+		shadow_queue_count++;
+		pthread_cond_signal(&shadow_cond);
+		input = output = NULL;
+	}
+	else
+	{
+		shadow_dropped++;
+	}
+	slurm_mutex_unlock(&shadow_lock);
+
+	Py_XDECREF(input);
+	Py_XDECREF(output);
+}
+
+/*
+ * Record that the candidate policy set ``field`` differently to the live
+ * policy
+ */
+static void shadow_count_diff(PyObject *field)
+{
+	PyObject *count = PyDict_GetItemWithError(shadow_field_diffs, field);
+	PyObject *updated = PyLong_FromUnsignedLongLong((count ? PyLong_AsUnsignedLongLong(count) : 0) + 1);
+	if (updated)
+	{
+		PyDict_SetItem(shadow_field_diffs, field, updated);
+		Py_DECREF(updated);
+	}
+	PyErr_Clear();
+}
+
+/*
+ * Compare the candidate policy's decision against the live one, returning the
+ * number of fields which differ
+ */
+static int shadow_compare(struct shadow_job *job, long rc)
+{
+	int diffs = 0;
+
+	if (rc != job->rc)
+	{
+		slurm_mutex_lock(&shadow_lock);
+		shadow_rc_mismatches++;
+		slurm_mutex_unlock(&shadow_lock);
+		diffs++;
+	}
+
+	PyObject *live = PyObject_GetAttrString(job->output, "__dict__");
+	PyObject *candidate = PyObject_GetAttrString(job->input, "__dict__");
+	if (live && candidate)
+	{
+		PyObject *key, *value;
+		Py_ssize_t pos = 0;
+
+		while (PyDict_Next(live, &pos, &key, &value))
+		{
+			PyObject *other = PyDict_GetItemWithError(candidate, key);
+			if (other == NULL || PyObject_RichCompareBool(value, other, Py_EQ) != 1)
+			{
+				PyErr_Clear();
+				shadow_count_diff(key);
+				diffs++;
+			}
+		}
+	}
+	Py_XDECREF(live);
+	Py_XDECREF(candidate);
+	PyErr_Clear();
+
+	return diffs;
+}
+
+/*
+ * Run the candidate policy on a queued job. Must be called with the GIL.
+ */
+static void run_shadow_job(struct shadow_job *job)
+{
+	struct call_context ctx;
+	long rc = SLURM_ERROR;
+	bool ok = false;
+
+	if (shadow_field_diffs == NULL)
+		shadow_field_diffs = PyDict_New();
+
+	// The candidate gets its own context so its messages go nowhere
+	call_context_begin(&ctx);
+
+	PyObject* pModule = load_script(conf.shadow_module);
+	PyObject* pFunc = pModule ? PyObject_GetAttrString(pModule, "job_submit") : NULL;
+	if (pFunc && PyCallable_Check(pFunc))
+	{
+		PyObject* p_submit_uid = PyLong_FromUnsignedLongLong(job->submit_uid);
+		uint64_t start = monotonic_ns();
+		PyObject* pRc = PyObject_CallFunctionObjArgs(pFunc, job->input, p_submit_uid, NULL);
+		latency_record(&shadow_candidate_latency, monotonic_ns() - start);
+		Py_DECREF(p_submit_uid);
+
+		if (pRc && PyLong_Check(pRc))
+		{
+			rc = PyLong_AsLong(pRc);
+			ok = true;
+		}
+		else if (pRc)
+		{
+			error("job_submit_python: return value of shadow policy \"%s\" must be an integer, not %s",
+			      conf.shadow_module, Py_TYPE(pRc)->tp_name);
+		}
+		Py_XDECREF(pRc);
+	}
+	else if (pModule)
+	{
+		error("job_submit_python: Cannot find function \"%s\" in shadow policy \"%s\"",
+		      "job_submit", conf.shadow_module);
+	}
+
+	if (!ok && PyErr_Occurred())
+	{
+		error("job_submit_python: Shadow policy \"%s\" failed", conf.shadow_module);
+		print_python_error();
+	}
+	Py_XDECREF(pFunc);
+	Py_XDECREF(pModule);
+
+	int diffs = ok ? shadow_compare(job, rc) : 0;
+
+	call_context_end(&ctx);
+
+	slurm_mutex_lock(&shadow_lock);
+	shadow_runs++;
+	if (!ok)
+		shadow_errors++;
+	else if (diffs == 0)
+		shadow_identical++;
+	slurm_mutex_unlock(&shadow_lock);
+
+	Py_DECREF(job->input);
+	Py_DECREF(job->output);
+}
+
+/*
+ * The shadow thread, which runs the candidate policy on queued jobs
+ */
+static void* shadow_thread_main(void *arg)
+{
+	slurm_mutex_lock(&shadow_lock);
+	while (!shadow_shutdown)
+	{
+		if (shadow_queue_count == 0)
+		{
+			slurm_cond_wait(&shadow_cond, &shadow_lock);
+			continue;
+		}
+
+		struct shadow_job job = shadow_queue[shadow_queue_head];
+		shadow_queue_head = (shadow_queue_head + 1) % SHADOW_QUEUE_SIZE;
+		shadow_queue_count--;
+		slurm_mutex_unlock(&shadow_lock);
+
+		PyGILState_STATE gstate = PyGILState_Ensure();
+		run_shadow_job(&job);
+		PyGILState_Release(gstate);
+
+		slurm_mutex_lock(&shadow_lock);
+	}
+	slurm_mutex_unlock(&shadow_lock);
+
+	return NULL;
+}
+
+/*
+ * Start the shadow thread if a candidate policy is configured
+ */
+static void start_shadow()
+{
+	if (conf.shadow_module == NULL)
+		return;
+
+	pthread_cond_init(&shadow_cond, NULL);
+	shadow_shutdown = false;
+	if (pthread_create(&shadow_thread, NULL, shadow_thread_main, NULL) == 0)
+		shadow_running = true;
+	else
+		error("job_submit_python: Could not start shadow thread");
+}
+
+/*
+ * Stop the shadow thread, leaving anything still queued for
+ * ``clear_shadow()``
+ */
+static void stop_shadow()
+{
+	if (!shadow_running)
+		return;
+
+	slurm_mutex_lock(&shadow_lock);
+	shadow_shutdown = true;
+	shadow_running = false;
+	pthread_cond_broadcast(&shadow_cond);
+	slurm_mutex_unlock(&shadow_lock);
+
+	pthread_join(shadow_thread, NULL);
+	pthread_cond_destroy(&shadow_cond);
+}
+
+/*
+ * Release the jobs which were never run and the shadow statistics. Must be
+ * called with the GIL.
+ */
+static void clear_shadow()
+{
+	while (shadow_queue_count > 0)
+	{
+		struct shadow_job *job = &shadow_queue[shadow_queue_head];
+		Py_DECREF(job->input);
+		Py_DECREF(job->output);
+		shadow_queue_head = (shadow_queue_head + 1) % SHADOW_QUEUE_SIZE;
+		shadow_queue_count--;
+	}
+	shadow_queue_head = 0;
+	Py_CLEAR(shadow_field_diffs);
+}
+
+/*
+ * Return a dict of statistics comparing the candidate policy to the live one,
+ * or None if there is no candidate
+ */
+static PyObject* shadow_stats()
+{
+	if (conf.shadow_module == NULL)
+		Py_RETURN_NONE;
+
+	PyObject* field_diffs = shadow_field_diffs ? PyDict_Copy(shadow_field_diffs) : PyDict_New();
+	PyObject* latency = Py_BuildValue("{s:N,s:N}",
+					  "live", latency_stats(&shadow_live_latency),
+					  "candidate", latency_stats(&shadow_candidate_latency));
+
+	slurm_mutex_lock(&shadow_lock);
+	PyObject* dict = Py_BuildValue("{s:s,s:K,s:K,s:K,s:K,s:K,s:K,s:N,s:N}",
+				       "module", conf.shadow_module,
+				       "runs", (unsigned long long)shadow_runs,
+				       "queued", (unsigned long long)shadow_queue_count,
+				       "dropped", (unsigned long long)shadow_dropped,
+				       "errors", (unsigned long long)shadow_errors,
+				       "identical", (unsigned long long)shadow_identical,
+				       "rc_mismatches", (unsigned long long)shadow_rc_mismatches,
+				       "field_diffs", field_diffs,
+				       "latency", latency);
+	slurm_mutex_unlock(&shadow_lock);
+
+	return dict;
+}
+
+/*
+ * Control of Python's cyclic garbage collector. After ``GCFreezeAfter``
+ * submissions the GC thread collects once and calls ``gc.freeze()`` so that
+ * the objects the policy has built up by then are never scanned again. When
+ * ``GCIdleInterval`` is set, automatic collection is disabled and the GC
+ * thread instead collects whenever no ``job_submit()`` call is in flight, so
+ * that collection pauses do not land on submissions. Collections are timed
+ * through ``gc.callbacks`` wherever they run.
+ */
+#define GC_FORCE_FACTOR 10	/* collect even when busy at this many times the threshold */
+#define GC_FREEZE_MAX_WAITS 10	/* freeze even when busy after this many ticks */
+
+struct gc_generation_stats {
+	uint64_t collections;
+	uint64_t collected;
+	uint64_t total_ns;
+	uint64_t max_ns;
+};
+
+static PyObject *gc_module = NULL;
+static struct gc_generation_stats gc_generations[3];
+static uint64_t gc_background = 0;		/* collections run by the GC thread */
+static uint64_t gc_inline = 0;			/* collections run by any other thread */
+static uint64_t gc_inline_max_ns = 0;
+static uint64_t gc_collection_start = 0;
+static bool gc_freeze_pending = false;	/* gc.freeze() is still to be called */
+static bool gc_frozen = false;
+static int gc_freeze_waits = 0;
+static long gc_rss_baseline = 0;
+static __thread bool gc_on_gc_thread = false;
+
+static uint32_t calls_in_flight = 0;	/* job_submit() calls started but not finished */
+static uint32_t calls_completed = 0;
+
+static pthread_mutex_t gc_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gc_cond;
+static pthread_t gc_thread;
+static bool gc_running = false;
+static bool gc_shutdown = false;
+
+/*
+ * Return the resident set size of slurmctld in bytes
+ */
+static long rss_bytes(void)
+{
+	long size = 0, resident = 0;
+	FILE *fp = fopen("/proc/self/statm", "r");
+	if (fp == NULL)
+		return 0;
+	if (fscanf(fp, "%ld %ld", &size, &resident) != 2)
+		resident = 0;
+	fclose(fp);
+	return resident * sysconf(_SC_PAGESIZE);
+}
+
+/*
+ * Called by Python at the start and end of every collection
+ */
+static PyObject* gc_callback(PyObject *self, PyObject *args)
+{
+	const char *phase;
+	PyObject *info;
+	if (!PyArg_ParseTuple(args, "sO", &phase, &info))
+		return NULL;
+
+	if (strcmp(phase, "start") == 0)
+	{
+		gc_collection_start = monotonic_ns();
+		Py_RETURN_NONE;
+	}
+
+	uint64_t duration = monotonic_ns() - gc_collection_start;
+	PyObject *p_generation = PyDict_GetItemString(info, "generation");
+	PyObject *p_collected = PyDict_GetItemString(info, "collected");
+	long generation = p_generation ? PyLong_AsLong(p_generation) : -1;
+	if (generation < 0 || generation > 2)
+	{
+		PyErr_Clear();
+		Py_RETURN_NONE;
+	}
+
+	struct gc_generation_stats *stats = &gc_generations[generation];
+	stats->collections++;
+	stats->collected += p_collected ? PyLong_AsUnsignedLongLong(p_collected) : 0;
+	stats->total_ns += duration;
+	if (duration > stats->max_ns)
+		stats->max_ns = duration;
+
+	if (gc_on_gc_thread)
+	{
+		gc_background++;
+	}
+	else
+	{
+		gc_inline++;
+		if (duration > gc_inline_max_ns)
+			gc_inline_max_ns = duration;
+	}
+
+	PyErr_Clear();
+	Py_RETURN_NONE;
+}
+
+static PyMethodDef gc_callback_def = {
+	"job_submit_python_gc_callback", gc_callback, METH_VARARGS, ""
+};
+
+/*
+ * Call ``gc.<name>()`` with ``args``, logging any failure
+ */
+static PyObject* gc_call(const char *name, PyObject *args)
+{
+	PyObject *func = PyObject_GetAttrString(gc_module, name);
+	PyObject *result = func ? PyObject_CallObject(func, args) : NULL;
+	Py_XDECREF(func);
+	if (result == NULL)
+	{
+		error("job_submit_python: gc.%s() failed", name);
+		print_python_error();
+	}
+	return result;
+}
+
+/*
+ * Return the generation which is due to be collected, or -1 if none is.
+ * With ``force`` only a generation far over its threshold is returned.
+ */
+static int gc_due_generation(bool force)
+{
+	int due = -1;
+	int counts[3], thresholds[3];
+
+	PyObject *p_counts = gc_call("get_count", NULL);
+	PyObject *p_thresholds = gc_call("get_threshold", NULL);
+	if (p_counts && p_thresholds &&
+	    PyArg_ParseTuple(p_counts, "iii", &counts[0], &counts[1], &counts[2]) &&
+	    PyArg_ParseTuple(p_thresholds, "iii", &thresholds[0], &thresholds[1], &thresholds[2]))
+	{
+		int factor = force ? GC_FORCE_FACTOR : 1;
+		for (int i = 0; i < 3; ++i)
+		{
+			if (thresholds[i] > 0 && counts[i] >= thresholds[i] * factor)
+				due = i;
+		}
+	}
+	PyErr_Clear();
+	Py_XDECREF(p_counts);
+	Py_XDECREF(p_thresholds);
+
+	return due;
+}
+
+/*
+ * Collect ``generation``. Must be called with the GIL.
+ */
+static void gc_collect(int generation)
+{
+	PyObject *args = Py_BuildValue("(i)", generation);
+	Py_XDECREF(gc_call("collect", args));
+	Py_XDECREF(args);
+}
+
+/*
+ * Do whatever collection or freezing is due, returning false once there will
+ * never be anything more to do. Must be called with the GIL.
+ */
+static bool gc_tick(void)
+{
+	bool idle = __atomic_load_n(&calls_in_flight, __ATOMIC_RELAXED) == 0;
+
+	// Prefer to freeze while idle, but do not wait for that forever
+	if (gc_freeze_pending &&
+	    __atomic_load_n(&calls_completed, __ATOMIC_RELAXED) >= conf.gc_freeze_after &&
+	    (idle || ++gc_freeze_waits >= GC_FREEZE_MAX_WAITS))
+	{
+		// Only tried once, as a failure would fail again
+		gc_freeze_pending = false;
+		gc_collect(2);
+		PyObject *result = gc_call("freeze", NULL);
+		if (result)
+		{
+			gc_frozen = true;
+			verbose("job_submit_python: Froze the garbage collector after %u submissions", conf.gc_freeze_after);
+		}
+		Py_XDECREF(result);
+	}
+
+	if (conf.gc_idle_interval)
+	{
+		int generation = gc_due_generation(!idle);
+		if (generation >= 0)
+			gc_collect(generation);
+	}
+
+	return conf.gc_idle_interval || gc_freeze_pending;
+}
+
+/*
+ * The GC thread
+ */
+static void* gc_thread_main(void *arg)
+{
+	uint32_t interval = conf.gc_idle_interval ? conf.gc_idle_interval : 1000;
+
+	gc_on_gc_thread = true;
+
+	slurm_mutex_lock(&gc_lock);
+	while (!gc_shutdown)
+	{
+		struct timespec wake;
+		clock_gettime(CLOCK_MONOTONIC, &wake);
+		timespec_add(&wake, interval / 1000.0);
+		pthread_cond_timedwait(&gc_cond, &gc_lock, &wake);
+		if (gc_shutdown)
+			break;
+		slurm_mutex_unlock(&gc_lock);
+
+		PyGILState_STATE gstate = PyGILState_Ensure();
+		bool more = gc_tick();
+		PyGILState_Release(gstate);
+
+		slurm_mutex_lock(&gc_lock);
+		if (!more)
+			break;
+	}
+	slurm_mutex_unlock(&gc_lock);
+
+	return NULL;
+}
+
+/*
+ * Apply the GC settings and install the timing callback. Must be called with
+ * the GIL.
+ */
+static void setup_gc()
+{
+	gc_module = PyImport_ImportModule("gc");
+	if (gc_module == NULL)
+	{
+		print_python_error();
+		return;
+	}
+
+	if (conf.gc_threshold)
+	{
+		int thresholds[3];
+		if (sscanf(conf.gc_threshold, "%d,%d,%d", &thresholds[0], &thresholds[1], &thresholds[2]) == 3)
+		{
+			PyObject *args = Py_BuildValue("(iii)", thresholds[0], thresholds[1], thresholds[2]);
+			Py_XDECREF(gc_call("set_threshold", args));
+			Py_XDECREF(args);
+		}
+		else
+		{
+			error("job_submit_python: GCThreshold must be three comma separated numbers, not \"%s\"", conf.gc_threshold);
+		}
+	}
+
+	PyObject *callbacks = PyObject_GetAttrString(gc_module, "callbacks");
+	PyObject *callback = PyCFunction_New(&gc_callback_def, NULL);
+	if (callbacks == NULL || callback == NULL || PyList_Append(callbacks, callback) != 0)
+		print_python_error();
+	Py_XDECREF(callback);
+	Py_XDECREF(callbacks);
+
+	if (conf.gc_idle_interval)
+		Py_XDECREF(gc_call("disable", NULL));
+
+	// gc.freeze() was added in Python 3.7
+	if (conf.gc_freeze_after && PyObject_HasAttrString(gc_module, "freeze"))
+		gc_freeze_pending = true;
+	else if (conf.gc_freeze_after)
+		verbose("job_submit_python: gc.freeze() is not available in this version of Python, not freezing");
+}
+
+/*
+ * Start the GC thread if there is anything for it to do
+ */
+static void start_gc()
+{
+	if (gc_module == NULL || (!gc_freeze_pending && conf.gc_idle_interval == 0))
+		return;
+
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&gc_cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	gc_shutdown = false;
+	if (pthread_create(&gc_thread, NULL, gc_thread_main, NULL) == 0)
+		gc_running = true;
+	else
+		error("job_submit_python: Could not start GC thread");
+}
+
+/*
+ * Stop the GC thread
+ */
+static void stop_gc()
+{
+	if (!gc_running)
+		return;
+
+	slurm_mutex_lock(&gc_lock);
+	gc_shutdown = true;
+	pthread_cond_broadcast(&gc_cond);
+	slurm_mutex_unlock(&gc_lock);
+
+	pthread_join(gc_thread, NULL);
+	pthread_cond_destroy(&gc_cond);
+	gc_running = false;
+}
+
+/*
+ * Release the ``gc`` module. Must be called with the GIL.
+ */
+static void clear_gc()
+{
+	Py_CLEAR(gc_module);
+}
+
+/*
+ * Return a dict of statistics about garbage collection and the interpreter's
+ * memory. Must be called with the GIL.
+ */
+static PyObject* gc_stats()
+{
+	PyObject *generations = PyList_New(3);
+	if (generations == NULL)
+		return NULL;
+	for (int i = 0; i < 3; ++i)
+	{
+		struct gc_generation_stats *stats = &gc_generations[i];
+		PyList_SET_ITEM(generations, i, Py_BuildValue("{s:K,s:K,s:d,s:d}",
+							    "collections", (unsigned long long)stats->collections,
+							    "collected", (unsigned long long)stats->collected,
+							    "time", stats->total_ns / 1e9,
+							    "max_pause", stats->max_ns / 1e9));
+	}
+
+	// pymalloc's arenas are not exposed, so report the blocks in use instead
+	PyObject *allocated_blocks = PyObject_CallObject(PySys_GetObject("getallocatedblocks"), NULL);
+	if (allocated_blocks == NULL)
+	{
+		PyErr_Clear();
+		allocated_blocks = (Py_INCREF(Py_None), Py_None);
+	}
+
+	long rss = rss_bytes();
+	return Py_BuildValue("{s:N,s:K,s:K,s:d,s:O,s:O,s:N,s:l,s:l}",
+			     "generations", generations,
+			     "background", (unsigned long long)gc_background,
+			     "inline", (unsigned long long)gc_inline,
+			     "inline_max_pause", gc_inline_max_ns / 1e9,
+			     "frozen", gc_frozen ? Py_True : Py_False,
+			     "idle", conf.gc_idle_interval ? Py_True : Py_False,
+			     "allocated_blocks", allocated_blocks,
+			     "rss", rss,
+			     "rss_delta", rss - gc_rss_baseline);
+}
+
+/*
+ * Per-call memory budget. When ``MemoryBudget`` is set, the ``PYMEM_DOMAIN_MEM``
+ * and ``PYMEM_DOMAIN_OBJ`` allocators are wrapped before Python starts so that
+ * every block carries its size in a small header. While the policy's
+ * ``job_submit()`` is running, the bytes it has allocated and not yet freed
+ * are counted for its thread, and any allocation which would take it over the
+ * budget fails, raising ``MemoryError`` in the script. The submission then
+ * gets the ``MemoryBudgetAction`` decision whatever the script returned.
+ *
+ * The header also records which call allocated the block, and only frees of
+ * blocks allocated by the running call are subtracted. Freeing data that was
+ * already there, such as a cache the script clears, does not make room for
+ * more than the budget.
+ */
+#define MEM_HEADER_SIZE 16	/* keeps the blocks 16 byte aligned */
+
+struct mem_header {
+	size_t size;
+	uint64_t call;		/* id of the call which allocated it, or 0 */
+};
+
+struct mem_call {
+	uint64_t id;
+	int64_t live;		/* bytes allocated minus bytes freed during the call */
+	int64_t peak;
+	bool exceeded;
+};
+
+static PyMemAllocatorEx mem_original[2];	/* the wrapped MEM and OBJ allocators */
+static bool mem_installed = false;
+static uint64_t mem_budget = 0;			/* in bytes */
+static __thread struct mem_call *mem_current = NULL;
+static uint64_t mem_call_ids = 0;
+
+static uint64_t mem_calls = 0;
+static uint64_t mem_exceeded = 0;
+static uint64_t mem_peak_max = 0;
+static uint64_t mem_peak_total = 0;
+
+/*
+ * Account for a change of ``delta`` bytes, returning false if it would go
+ * over the budget
+ */
+static bool mem_account(int64_t delta)
+{
+	struct mem_call *call = mem_current;
+	if (call == NULL)
+		return true;
+
+	if (delta > 0 && call->live + delta > (int64_t)mem_budget)
+	{
+		call->exceeded = true;
+		return false;
+	}
+
+	call->live += delta;
+	if (call->live > call->peak)
+		call->peak = call->live;
+	return true;
+}
+
+/*
+ * Return the id of the running call, or 0 outside of one
+ */
+static uint64_t mem_call_id(void)
+{
+	return mem_current ? mem_current->id : 0;
+}
+
+/*
+ * Return true if the block was allocated by the running call, so its size
+ * has been counted
+ */
+static bool mem_counted(struct mem_header *header)
+{
+	return header->call != 0 && header->call == mem_call_id();
+}
 
-#if SLURM_VERSION_NUMBER < SLURM_VERSION_NUM(17,11,0)
-#define NO_VAL8 (0xfe)
-#endif
+static void* mem_malloc(void *ctx, size_t size)
+{
+	PyMemAllocatorEx *original = ctx;
+	if (size > PY_SSIZE_T_MAX - MEM_HEADER_SIZE || !mem_account(size))
+		return NULL;
 
-const char plugin_name[]="Job submit Python plugin";
-const char plugin_type[] = "job_submit/python";
-const uint32_t plugin_version = SLURM_VERSION_NUMBER;
+	struct mem_header *header = original->malloc(original->ctx, size + MEM_HEADER_SIZE);
+	if (header == NULL)
+	{
+		mem_account(-(int64_t)size);
+		return NULL;
+	}
+	header->size = size;
+	header->call = mem_call_id();
+	return (char*)header + MEM_HEADER_SIZE;
+}
 
-static char *user_msg = NULL;
+static void* mem_calloc(void *ctx, size_t nelem, size_t elsize)
+{
+	if (elsize != 0 && nelem > (PY_SSIZE_T_MAX - MEM_HEADER_SIZE) / elsize)
+		return NULL;
 
-static pthread_mutex_t python_lock = PTHREAD_MUTEX_INITIALIZER;
+	void *ptr = mem_malloc(ctx, nelem * elsize);
+	if (ptr)
+		memset(ptr, 0, nelem * elsize);
+	return ptr;
+}
+
+static void* mem_realloc(void *ctx, void *ptr, size_t new_size)
+{
+	PyMemAllocatorEx *original = ctx;
+	if (ptr == NULL)
+		return mem_malloc(ctx, new_size);
+
+	struct mem_header *header = (struct mem_header*)((char*)ptr - MEM_HEADER_SIZE);
+	int64_t delta = (int64_t)new_size - (int64_t)header->size;
+
+	// Only growth is counted for blocks from before the call, as their old size never was
+	if (!mem_counted(header) && delta < 0)
+		delta = 0;
+	if (new_size > PY_SSIZE_T_MAX - MEM_HEADER_SIZE || !mem_account(delta))
+		return NULL;
+
+	struct mem_header *new_header = original->realloc(original->ctx, header, new_size + MEM_HEADER_SIZE);
+	if (new_header == NULL)
+	{
+		mem_account(-delta);
+		return NULL;
+	}
+	new_header->size = new_size;
+	return (char*)new_header + MEM_HEADER_SIZE;
+}
+
+static void mem_free(void *ctx, void *ptr)
+{
+	PyMemAllocatorEx *original = ctx;
+	if (ptr == NULL)
+		return;
+
+	struct mem_header *header = (struct mem_header*)((char*)ptr - MEM_HEADER_SIZE);
+	if (mem_counted(header))
+		mem_account(-(int64_t)header->size);
+	original->free(original->ctx, header);
+}
 
 /*
- * Function to register into Python namespace to allow the plugin writer to
- * return information to the user running sbatch.
+ * Wrap Python's allocators if a budget is set. Must be called before
+ * ``Py_Initialize()``, and the wrappers are never removed as blocks allocated
+ * through them may outlive the interpreter.
  */
-static PyObject* slurm_user_msg(PyObject *self, PyObject *arg)
+static void install_memory_budget()
 {
-	const char* msg = PyUnicode_AsUTF8(arg);
-	char *tmp = NULL;
-	if (user_msg) {
-		xstrfmtcat(tmp, "%s\n%s", user_msg, msg);
-		xfree(user_msg);
-		user_msg = tmp;
-		tmp = NULL;
-	} else {
-		user_msg = xstrdup(msg);
+	mem_budget = (uint64_t)conf.memory_budget * 1024 * 1024;
+	if (mem_budget == 0 || mem_installed)
+		return;
+
+#ifdef Py_GIL_DISABLED
+	// The free-threaded collector finds objects by walking mimalloc's heaps,
+	// so their blocks cannot carry a header
+	error("job_submit_python: MemoryBudget is not supported with free-threaded Python");
+	mem_budget = 0;
+	return;
+#endif
+
+	PyMemAllocatorDomain domains[2] = {PYMEM_DOMAIN_MEM, PYMEM_DOMAIN_OBJ};
+	for (int i = 0; i < 2; ++i)
+	{
+		PyMem_GetAllocator(domains[i], &mem_original[i]);
+		PyMemAllocatorEx wrapper = {&mem_original[i], mem_malloc, mem_calloc, mem_realloc, mem_free};
+		PyMem_SetAllocator(domains[i], &wrapper);
 	}
-	Py_RETURN_NONE;
+	mem_installed = true;
 }
 
 /*
- * Function to register into Python namespace to allow the plugin writer to
- * write an info message into the log
+ * Start counting the policy's allocations on this thread
  */
-static PyObject* slurm_info(PyObject *self, PyObject *arg)
+static void mem_call_begin(struct mem_call *call)
 {
-	PyObject* str = PyObject_Str(arg);
-	info("job_submit_python: %s", PyUnicode_AsUTF8(str));
-	Py_DECREF(str);
-	Py_RETURN_NONE;
+	memset(call, 0, sizeof(struct mem_call));
+	if (mem_installed && mem_budget)
+	{
+		call->id = __atomic_add_fetch(&mem_call_ids, 1, __ATOMIC_RELAXED);
+		mem_current = call;
+	}
+}
+
+/*
+ * Stop counting the policy's allocations on this thread, returning true if
+ * it went over the budget
+ */
+static bool mem_call_end(struct mem_call *call)
+{
+	if (mem_current != call)
+		return false;
+	mem_current = NULL;
+
+	__atomic_fetch_add(&mem_calls, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&mem_peak_total, call->peak, __ATOMIC_RELAXED);
+	if (call->exceeded)
+		__atomic_fetch_add(&mem_exceeded, 1, __ATOMIC_RELAXED);
+
+	uint64_t max = __atomic_load_n(&mem_peak_max, __ATOMIC_RELAXED);
+	while ((uint64_t)call->peak > max && !__atomic_compare_exchange_n(&mem_peak_max, &max, call->peak, false,
+									  __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+
+	return call->exceeded;
+}
+
+/*
+ * Return a dict of statistics about the policy's memory use, or None if
+ * there is no budget
+ */
+static PyObject* memory_stats()
+{
+	if (!mem_installed || mem_budget == 0)
+		Py_RETURN_NONE;
+
+	uint64_t calls = __atomic_load_n(&mem_calls, __ATOMIC_RELAXED);
+	uint64_t total = __atomic_load_n(&mem_peak_total, __ATOMIC_RELAXED);
+	return Py_BuildValue("{s:K,s:s,s:K,s:K,s:K,s:d}",
+			     "budget", (unsigned long long)mem_budget,
+			     "action", conf.memory_budget_reject ? "reject" : "accept",
+			     "calls", (unsigned long long)calls,
+			     "exceeded", (unsigned long long)__atomic_load_n(&mem_exceeded, __ATOMIC_RELAXED),
+			     "peak_max", (unsigned long long)__atomic_load_n(&mem_peak_max, __ATOMIC_RELAXED),
+			     "peak_mean", calls ? (double)total / calls : 0.0);
+}
+
+/*
+ * The ``slurm.span`` context manager, which records a span in the trace of
+ * the current call. It does nothing if the call is not being traced.
+ */
+typedef struct {
+	PyObject_HEAD
+	char name[TRACE_NAME_LEN];
+	int index;
+} SpanObject;
+
+static int span_init(SpanObject *self, PyObject *args, PyObject *kwds)
+{
+	const char *name;
+
+	if (!PyArg_ParseTuple(args, "s", &name))
+		return -1;
+
+	snprintf(self->name, TRACE_NAME_LEN, "%s", name);
+	self->index = -1;
+	return 0;
+}
+
+static PyObject* span_enter(SpanObject *self, PyObject *args)
+{
+	self->index = trace_span_begin(self->name);
+	Py_INCREF(self);
+	return (PyObject*)self;
+}
+
+static PyObject* span_exit(SpanObject *self, PyObject *args)
+{
+	trace_span_end(self->index);
+	self->index = -1;
+	Py_RETURN_FALSE;
+}
+
+static PyMethodDef SpanMethods[] = {
+	{
+		"__enter__", (PyCFunction)span_enter, METH_NOARGS, ""
+	},
+	{
+		"__exit__", (PyCFunction)span_exit, METH_VARARGS, ""
+	},
+	{
+		NULL, NULL, 0, NULL
+	}
+};
+
+static PyTypeObject SpanType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	.tp_name = "slurm.span",
+	.tp_basicsize = sizeof(SpanObject),
+	.tp_flags = Py_TPFLAGS_DEFAULT,
+	.tp_methods = SpanMethods,
+	.tp_init = (initproc)span_init,
+	.tp_new = PyType_GenericNew,
+};
+
+/*
+ * Insert ``obj`` into the stats ``dict`` with key ``name``, dropping it if it
+ * could not be created
+ */
+static void insert_stats(PyObject* dict, const char* name, PyObject* obj)
+{
+	if (obj != NULL)
+	{
+		PyDict_SetItemString(dict, name, obj);
+		Py_DECREF(obj);
+	}
+	else
+	{
+		PyErr_Clear();
+	}
 }
 
 /*
  * Function to register into Python namespace to allow the plugin writer to
- * write an error message into the log
+ * read the plugin's statistics
  */
-static PyObject* slurm_error(PyObject *self, PyObject *arg)
+static PyObject* slurm_stats(PyObject *self, PyObject *args)
 {
-	PyObject* str = PyObject_Str(arg);
-	error("job_submit_python: %s", PyUnicode_AsUTF8(str));
-	Py_DECREF(str);
-	Py_RETURN_NONE;
+	PyObject* dict = PyDict_New();
+	insert_stats(dict, "tasks", periodic_task_stats());
+	insert_stats(dict, "profile", Py_BuildValue("{s:K}", "samples", (unsigned long long)profile_samples));
+	insert_stats(dict, "identity_cache", identity_cache_stats());
+	insert_stats(dict, "shadow", shadow_stats());
+	insert_stats(dict, "gc", gc_stats());
+	insert_stats(dict, "memory", memory_stats());
+	return dict;
 }
 
 /*
@@ -98,6 +3543,48 @@ static PyMethodDef SlurmMethods[] = {
 	{
 		"error", slurm_error, METH_O, ""
 	},
+	{
+		"parse_tres", slurm_parse_tres, METH_O, ""
+	},
+	{
+		"format_tres", slurm_format_tres, METH_O, ""
+	},
+	{
+		"hostlist_expand", slurm_hostlist_expand, METH_O, ""
+	},
+	{
+		"hostlist_count", slurm_hostlist_count, METH_O, ""
+	},
+	{
+		"hostlist_compress", slurm_hostlist_compress, METH_O, ""
+	},
+	{
+		"parse_time", slurm_parse_time, METH_O, ""
+	},
+	{
+		"format_time", slurm_format_time, METH_O, ""
+	},
+	{
+		"every", slurm_every, METH_VARARGS, ""
+	},
+	{
+		"result", slurm_result, METH_O, ""
+	},
+	{
+		"cancel", slurm_cancel, METH_O, ""
+	},
+	{
+		"stats", slurm_stats, METH_NOARGS, ""
+	},
+	{
+		"profile_dump", slurm_profile_dump, METH_NOARGS, ""
+	},
+	{
+		"user", slurm_user, METH_O, ""
+	},
+	{
+		"groups", slurm_groups, METH_O, ""
+	},
 	{
 		NULL, NULL, 0, NULL
 	}
@@ -106,16 +3593,65 @@ static PyMethodDef SlurmMethods[] = {
 /*
  * Define the ``slurm`` module with the registered functions
  */
+static int slurm_module_traverse(PyObject *module, visitproc visit, void *arg)
+{
+	struct slurm_module_state *state = PyModule_GetState(module);
+	Py_VISIT(state->simple_namespace);
+	return 0;
+}
+
+static int slurm_module_clear(PyObject *module)
+{
+	struct slurm_module_state *state = PyModule_GetState(module);
+	Py_CLEAR(state->simple_namespace);
+	return 0;
+}
+
 static PyModuleDef SlurmModule = {
-	PyModuleDef_HEAD_INIT, "slurm", NULL, -1, SlurmMethods, NULL, NULL, NULL, NULL
+	PyModuleDef_HEAD_INIT, "slurm", NULL, sizeof(struct slurm_module_state), SlurmMethods, NULL,
+	slurm_module_traverse, slurm_module_clear, NULL
 };
 
+/*
+ * Return the state of the ``slurm`` module
+ */
+static struct slurm_module_state* slurm_module_state()
+{
+	PyObject* module = PyState_FindModule(&SlurmModule);
+	return module ? PyModule_GetState(module) : NULL;
+}
+
 /*
  * Create the ``slurm`` module
  */
 static PyObject* PyInit_slurm()
 {
-	return PyModule_Create(&SlurmModule);
+	if (PyType_Ready(&SpanType) < 0)
+		return NULL;
+
+	PyObject* module = PyModule_Create(&SlurmModule);
+	if (module == NULL)
+		return NULL;
+
+#ifdef Py_GIL_DISABLED
+	// Nothing in the module relies on the GIL for its own consistency
+	PyUnstable_Module_SetGIL(module, Py_MOD_GIL_NOT_USED);
+#endif
+
+	struct slurm_module_state *state = PyModule_GetState(module);
+	PyObject *p_types_module = PyImport_ImportModule("types");
+	if (p_types_module == NULL)
+	{
+		Py_DECREF(module);
+		return NULL;
+	}
+	state->simple_namespace = PyObject_GetAttrString(p_types_module, "SimpleNamespace");
+	Py_DECREF(p_types_module);
+
+	Py_INCREF(&SpanType);
+	PyModule_AddObject(module, "span", (PyObject*)&SpanType);
+
+	return module;
 }
 
 /*
@@ -123,6 +3659,10 @@ static PyObject* PyInit_slurm()
  */
 int init(void)
 {
+	read_python_conf();
+	gc_rss_baseline = rss_bytes();
+	install_memory_budget();
+
 	// Create the slurm module and put it in the path
 	PyImport_AppendInittab("slurm", &PyInit_slurm);
 	Py_Initialize();
@@ -133,6 +3673,28 @@ int init(void)
 	PyList_Append(sysPath, script_path);
 	Py_DECREF(script_path);
 
+	// Import the slurm module now so that its state can always be found
+	PyObject* slurm_module = PyImport_ImportModule("slurm");
+	if (slurm_module == NULL)
+		print_python_error();
+	Py_XDECREF(slurm_module);
+
+	setup_gc();
+
+	// Release the GIL so that it can be taken by whichever thread calls
+	// ``job_submit()`` and by the periodic task thread
+#if PY_VERSION_HEX < 0x03070000
+	PyEval_InitThreads();
+#endif
+	start_profiler();
+	main_thread_state = PyEval_SaveThread();
+
+	start_periodic_tasks();
+	start_trace_writer();
+	start_identity_cache();
+	start_shadow();
+	start_gc();
+
 	return SLURM_SUCCESS;
 }
 
@@ -141,7 +3703,24 @@ int init(void)
  */
 int fini(void)
 {
+	stop_periodic_tasks();
+	stop_trace_writer();
+	stop_profiler();
+	stop_identity_cache();
+	stop_shadow();
+	stop_gc();
+
+	PyEval_RestoreThread(main_thread_state);
+	clear_periodic_tasks();
+	clear_profiler();
+	clear_shadow();
+	clear_gc();
 	Py_Finalize();
+#ifdef JOB_SUBMIT_PYTHON_NO_LOCK
+	script_versions_clear();
+#endif
+	arena_pool_destroy();
+	free_python_conf();
 	return SLURM_SUCCESS;
 }
 
@@ -154,28 +3733,38 @@ void print_python_error()
 	{
 		PyObject *ptype, *pvalue, *ptraceback;
 		PyErr_Fetch(&ptype, &pvalue, &ptraceback);
-		//PyErr_NormalizeException(&ptype, &pvalue, &ptraceback);
+		PyErr_NormalizeException(&ptype, &pvalue, &ptraceback);
+
+		if (current_context)
+			current_context->errors++;
 
-		// Import the ``traceback`` module
-		PyObject *pTracebackModuleName = PyUnicode_FromString("traceback");
-		PyObject *pTracebackModule = PyImport_Import(pTracebackModuleName);
-		Py_DECREF(pTracebackModuleName);
+		if (ptraceback)
+		{
+			// Import the ``traceback`` module
+			PyObject *pTracebackModule = PyImport_ImportModule("traceback");
 
-		// Get the ``traceback.format_tb`` function
-		PyObject* pFormatTbFn = PyObject_GetAttrString(pTracebackModule, "format_tb");
-		Py_DECREF(pTracebackModule);
+			// Get the ``traceback.format_tb`` function
+			PyObject* pFormatTbFn = pTracebackModule ? PyObject_GetAttrString(pTracebackModule, "format_tb") : NULL;
+			Py_XDECREF(pTracebackModule);
 
-		// Get the formatted traceback
-		PyObject* pFormattedTb = PyObject_CallFunctionObjArgs(pFormatTbFn, ptraceback, NULL);
-		Py_DECREF(pFormatTbFn);
-		Py_XDECREF(ptraceback);
+			// Get the formatted traceback
+			PyObject* pFormattedTb = pFormatTbFn ? PyObject_CallFunctionObjArgs(pFormatTbFn, ptraceback, NULL) : NULL;
+			Py_XDECREF(pFormatTbFn);
 
-		PyObject* pFormattedTbStr = PyObject_Str(pFormattedTb);
+			PyObject* pFormattedTbStr = pFormattedTb ? PyObject_Str(pFormattedTb) : NULL;
+			Py_XDECREF(pFormattedTb);
 
-		error("job_submit_python: %s", PyUnicode_AsUTF8(pFormattedTbStr));
-		error("job_submit_python: %s: %s", PyUnicode_AsUTF8(ptype), PyUnicode_AsUTF8(pvalue));
+			if (pFormattedTbStr)
+				error("job_submit_python: %s", PyUnicode_AsUTF8(pFormattedTbStr));
+			Py_XDECREF(pFormattedTbStr);
+			PyErr_Clear();
+		}
+
+		PyObject* pValueStr = pvalue ? PyObject_Str(pvalue) : NULL;
+		error("job_submit_python: %s: %s", ((PyTypeObject*)ptype)->tp_name, pValueStr ? PyUnicode_AsUTF8(pValueStr) : "");
 
-		Py_DECREF(pFormattedTbStr);
+		Py_XDECREF(pValueStr);
+		Py_XDECREF(ptraceback);
 		Py_XDECREF(pvalue);
 		Py_DECREF(ptype);
 
@@ -228,22 +3817,23 @@ PyObject* char_star_star_to_python_dict(uint32_t num_strings, char** str_list)
 		char* eq = xstrchr(str_list[i], '=');
 		size_t eq_position = (size_t)(eq - str_list[i]);
 		PyObject* str_val = PyUnicode_FromString(str_list[i] + eq_position + 1);
-		PyDict_SetItemString(dict, xstrndup(str_list[i], eq_position), str_val);
+		PyDict_SetItemString(dict, arena_strndup(current_context->arena, str_list[i], eq_position), str_val);
+		Py_DECREF(str_val);
 	}
 
 	return dict;
 }
 
-#define insert_char_star(job_desc, dict, name) do { if(job_desc->name != NULL) insert_object(dict, #name, PyUnicode_FromString(job_desc->name)); else insert_object(dict, #name, Py_None); } while (0)
-#define insert_char_star_star(job_desc, dict, name, count) do { if(job_desc->name != NULL) insert_object(dict, #name, char_star_star_to_python(job_desc->count, job_desc->name)); else insert_object(dict, #name, Py_None); } while (0)
-#define insert_environment_dict(job_desc, dict, name, count) do { if(job_desc->name != NULL) insert_object(dict, #name, char_star_star_to_python_dict(job_desc->count, job_desc->name)); else insert_object(dict, #name, Py_None); } while (0)
-#define insert_uint8_t(job_desc, dict, name) do { if(job_desc->name != NO_VAL8) insert_object(dict, #name, PyLong_FromUnsignedLong(job_desc->name)); else insert_object(dict, #name, Py_None); } while (0)
-#define insert_uint16_t(job_desc, dict, name) do { if(job_desc->name != NO_VAL16) insert_object(dict, #name, PyLong_FromUnsignedLong(job_desc->name)); else insert_object(dict, #name, Py_None); } while (0)
-#define insert_uint32_t(job_desc, dict, name) do { if(job_desc->name != NO_VAL) insert_object(dict, #name, PyLong_FromUnsignedLong(job_desc->name)); else insert_object(dict, #name, Py_None); } while (0)
-#define insert_uint64_t(job_desc, dict, name) do { if(job_desc->name != NO_VAL64) insert_object(dict, #name, PyLong_FromUnsignedLongLong(job_desc->name)); else insert_object(dict, #name, Py_None); } while (0)
+#define insert_char_star(job_desc, dict, name) do { if(job_desc->name != NULL) insert_object(dict, #name, PyUnicode_FromString(job_desc->name)); else insert_object(dict, #name, (Py_INCREF(Py_None), Py_None)); } while (0)
+#define insert_char_star_star(job_desc, dict, name, count) do { if(job_desc->name != NULL) insert_object(dict, #name, char_star_star_to_python(job_desc->count, job_desc->name)); else insert_object(dict, #name, (Py_INCREF(Py_None), Py_None)); } while (0)
+#define insert_environment_dict(job_desc, dict, name, count) do { if(job_desc->name != NULL) insert_object(dict, #name, char_star_star_to_python_dict(job_desc->count, job_desc->name)); else insert_object(dict, #name, (Py_INCREF(Py_None), Py_None)); } while (0)
+#define insert_uint8_t(job_desc, dict, name) do { if(job_desc->name != NO_VAL8) insert_object(dict, #name, PyLong_FromUnsignedLong(job_desc->name)); else insert_object(dict, #name, (Py_INCREF(Py_None), Py_None)); } while (0)
+#define insert_uint16_t(job_desc, dict, name) do { if(job_desc->name != NO_VAL16) insert_object(dict, #name, PyLong_FromUnsignedLong(job_desc->name)); else insert_object(dict, #name, (Py_INCREF(Py_None), Py_None)); } while (0)
+#define insert_uint32_t(job_desc, dict, name) do { if(job_desc->name != NO_VAL) insert_object(dict, #name, PyLong_FromUnsignedLong(job_desc->name)); else insert_object(dict, #name, (Py_INCREF(Py_None), Py_None)); } while (0)
+#define insert_uint64_t(job_desc, dict, name) do { if(job_desc->name != NO_VAL64) insert_object(dict, #name, PyLong_FromUnsignedLongLong(job_desc->name)); else insert_object(dict, #name, (Py_INCREF(Py_None), Py_None)); } while (0)
 #define insert_time_t(job_desc, dict, name) do { insert_object(dict, #name, PyLong_FromUnsignedLong(job_desc->name)); } while (0)
-#define insert_uint8_t_to_bool(job_desc, dict, name) do { if(job_desc->name != NO_VAL8) {insert_object(dict, #name, PyBool_FromLong(job_desc->name));} else insert_object(dict, #name, Py_None); } while (0)
-#define insert_uint16_t_to_bool(job_desc, dict, name) do { if(job_desc->name != NO_VAL16) {insert_object(dict, #name, PyBool_FromLong(job_desc->name));} else insert_object(dict, #name, Py_None); } while (0)
+#define insert_uint8_t_to_bool(job_desc, dict, name) do { if(job_desc->name != NO_VAL8) {insert_object(dict, #name, PyBool_FromLong(job_desc->name));} else insert_object(dict, #name, (Py_INCREF(Py_None), Py_None)); } while (0)
+#define insert_uint16_t_to_bool(job_desc, dict, name) do { if(job_desc->name != NO_VAL16) {insert_object(dict, #name, PyBool_FromLong(job_desc->name));} else insert_object(dict, #name, (Py_INCREF(Py_None), Py_None)); } while (0)
 
 /*
  * Return a namespace object representing the ``job_descriptor`` struct
@@ -391,12 +3981,11 @@ PyObject* create_job_desc_dict(struct job_descriptor *job_desc)
 	insert_char_star(job_desc, pJobDesc, x11_target);
 	#endif
 
-	PyObject *p_types_module = PyImport_ImportModule("types");
-	PyObject* p_simplenamespace = PyObject_GetAttrString(p_types_module, "SimpleNamespace");
-	Py_DECREF(p_types_module);
+	struct slurm_module_state *state = slurm_module_state();
+	PyObject* args = PyTuple_New(0);
 
-	PyObject* new_obj = PyObject_Call(p_simplenamespace, NULL, pJobDesc);
-	Py_DECREF(p_simplenamespace);
+	PyObject* new_obj = state ? PyObject_Call(state->simple_namespace, args, pJobDesc) : NULL;
+	Py_DECREF(args);
 	Py_DECREF(pJobDesc);
 
 	return new_obj;
@@ -460,7 +4049,7 @@ void python_dict_to_environment(PyObject* obj, uint32_t* num_strings_p, char***
 	{
 		char* eq = xstrchr((*str_list_p)[i], '=');
 		size_t eq_position = (size_t)(eq - (*str_list_p)[i]);
-		char* key = xstrndup((*str_list_p)[i], eq_position);
+		char* key = arena_strndup(current_context->arena, (*str_list_p)[i], eq_position);
 		char* value = (*str_list_p)[i] + eq_position + 1;
 		if (PyMapping_HasKeyString(obj, key))
 		{
@@ -500,11 +4089,11 @@ void python_dict_to_environment(PyObject* obj, uint32_t* num_strings_p, char***
 		char* key = PyUnicode_AsUTF8(PyTuple_GetItem(item, 0));
 		PyObject* p_value = PyTuple_GetItem(item, 1);
 		PyObject* p_str = PyObject_Str(p_value);
-		Py_DECREF(p_value);
 
 		const int new_index = (*num_strings_p) - PyMapping_Length(obj) + i;
 
 		(*str_list_p)[new_index] = xstrdup_printf("%s=%s", key, PyUnicode_AsUTF8(p_str));
+		Py_DECREF(p_str);
 	}
 	Py_DECREF(remaining_items);
 }
@@ -552,14 +4141,19 @@ void python_to_char_star_star(PyObject* obj, uint32_t* num_strings_p, char*** st
 		*str_list_p = xrealloc(*str_list_p, sizeof(char*) * (*num_strings_p));
 	}
 
-	// Fill the array with the values from the list
+	// Fill the array with the values from the list, keeping any strings
+	// which are unchanged
 	for (int i = 0; i < python_count; ++i)
 	{
 		PyObject* obj = PySequence_Fast_GET_ITEM(list, i);
 		PyObject* str = PyObject_Str(obj);
 		char* s = PyUnicode_AsUTF8(str);
 
-		(*str_list_p)[i] = xstrdup(s);
+		if (xstrcmp((*str_list_p)[i], s) != 0)
+		{
+			xfree((*str_list_p)[i]);
+			(*str_list_p)[i] = xstrdup(s);
+		}
 
 		Py_DECREF(str);
 	}
@@ -573,7 +4167,7 @@ do { \
 	PyObject* o = PyObject_GetAttrString(dict, #name); \
 	if (o != NULL) { \
 		if (o == Py_None) { \
-			job_desc->name = NULL; \
+			xfree(job_desc->name); \
 		} else { \
 			char* s = PyUnicode_AsUTF8(o); \
 			if (job_desc->name == NULL || strcmp(s, job_desc->name) != 0) { \
@@ -581,7 +4175,7 @@ do { \
 				job_desc->name = xstrdup(s); \
 			} \
 		} \
-		PyDict_DelItemString(dict, #name); \
+		Py_DECREF(o); \
 	} \
 } while (0)
 #define retrieve_char_star_star(job_desc, dict, name, count) \
@@ -589,7 +4183,7 @@ do { \
 	PyObject* o = PyObject_GetAttrString(dict, #name); \
 	if (o != NULL) { \
 		python_to_char_star_star(o, &job_desc->count, &job_desc->name); \
-		PyDict_DelItemString(dict, #name); \
+		Py_DECREF(o); \
 	} \
 } while (0)
 #define retrieve_environment_dict(job_desc, dict, name, count) \
@@ -597,7 +4191,7 @@ do { \
 	PyObject* o = PyObject_GetAttrString(dict, #name); \
 	if (o != NULL) { \
 		python_dict_to_environment(o, &job_desc->count, &job_desc->name); \
-		PyDict_DelItemString(dict, #name); \
+		Py_DECREF(o); \
 	} \
 } while (0)
 #define retrieve_int(job_desc, dict, name, noval) \
@@ -609,7 +4203,7 @@ do { \
 		} else { \
 			job_desc->name = PyLong_AsUnsignedLong(o); \
 		} \
-		PyDict_DelItemString(dict, #name); \
+		Py_DECREF(o); \
 	} \
 } while (0)
 #define retrieve_uint8_t(job_desc, dict, name) retrieve_int(job_desc, dict, name, NO_VAL8)
@@ -625,7 +4219,7 @@ do { \
 		} else { \
 			job_desc->name = PyLong_AsUnsignedLong(o); \
 		} \
-		PyDict_DelItemString(dict, #name); \
+		Py_DECREF(o); \
 	} \
 } while (0)
 #define retrieve_uint8_t_as_bool(job_desc, dict, name) retrieve_int_as_bool(job_desc, dict, name, NO_VAL8)
@@ -635,7 +4229,7 @@ do { \
 	PyObject* o = PyObject_GetAttrString(dict, #name); \
 	if (o != NULL) { \
 		job_desc->name = PyLong_AsUnsignedLong(o); \
-		PyDict_DelItemString(dict, #name); \
+		Py_DECREF(o); \
 	} \
 } while (0)
 
@@ -784,58 +4378,220 @@ void retrieve_job_desc_dict(struct job_descriptor *job_desc, PyObject* pJobDesc)
 	#endif
 }
 
+#ifdef JOB_SUBMIT_PYTHON_NO_LOCK
+/*
+ * Read the version of ``module``'s file into ``version``. Returns false if
+ * the file cannot be found.
+ */
+static bool script_version_read(PyObject *module, struct script_version *version)
+{
+	PyObject *filename = PyModule_GetFilenameObject(module);
+	struct stat st;
+	bool found = filename && PyUnicode_Check(filename) && stat(PyUnicode_AsUTF8(filename), &st) == 0;
+	Py_XDECREF(filename);
+	PyErr_Clear();
+
+	if (found)
+	{
+		version->dev = st.st_dev;
+		version->ino = st.st_ino;
+		version->size = st.st_size;
+		version->mtime = st.st_mtim;
+	}
+	return found;
+}
+
+/*
+ * Return true if ``module`` has not been loaded from its current file. The
+ * current version is returned in ``version``.
+ */
+static bool script_changed(PyObject *module, const char *script_name, struct script_version *version)
+{
+	if (!script_version_read(module, version))
+		return true;
+
+	bool changed = true;
+	slurm_mutex_lock(&script_version_lock);
+	for (int i = 0; i < script_version_count; ++i)
+	{
+		struct script_version *loaded = &script_versions[i];
+		if (strcmp(loaded->name, script_name) == 0)
+		{
+			changed = loaded->dev != version->dev || loaded->ino != version->ino ||
+				  loaded->size != version->size ||
+				  loaded->mtime.tv_sec != version->mtime.tv_sec ||
+				  loaded->mtime.tv_nsec != version->mtime.tv_nsec;
+			break;
+		}
+	}
+	slurm_mutex_unlock(&script_version_lock);
+
+	return changed;
+}
+
+/*
+ * Record that ``script_name`` has been loaded from ``version`` of its file
+ */
+static void script_loaded(const char *script_name, struct script_version *version)
+{
+	slurm_mutex_lock(&script_version_lock);
+	int i;
+	for (i = 0; i < script_version_count; ++i)
+	{
+		if (strcmp(script_versions[i].name, script_name) == 0)
+			break;
+	}
+	if (i == script_version_count)
+	{
+		xrealloc(script_versions, sizeof(struct script_version) * (script_version_count + 1));
+		script_versions[script_version_count++].name = xstrdup(script_name);
+	}
+	char *name = script_versions[i].name;
+	script_versions[i] = *version;
+	script_versions[i].name = name;
+	slurm_mutex_unlock(&script_version_lock);
+}
+
 /*
- * Load the Python job-submit script and return it
+ * Forget which versions of the scripts have been loaded
  */
-PyObject* load_script()
+static void script_versions_clear(void)
 {
-	char script_name[] = "job_submit";
+	for (int i = 0; i < script_version_count; ++i)
+		xfree(script_versions[i].name);
+	xfree(script_versions);
+	script_version_count = 0;
+}
+#endif
 
+/*
+ * Load the Python module ``script_name`` and return it. With
+ * ``python_lock`` the module is reloaded on every call; without it, only
+ * when its file has changed.
+ */
+PyObject* load_script(const char *script_name)
+{
 	// Import the job_submit module
+	uint64_t generation = periodic_task_load_begin();
 	PyObject *pModuleInitial = PyImport_ImportModule(script_name);
 
-	if (pModuleInitial != NULL)
+	if (pModuleInitial == NULL)
 	{
-		verbose("job_submit_python: Loaded \"%s\"", script_name);
+		periodic_task_load_end(script_name, generation, false);
+		error("job_submit_python: Failed to load \"%s\"", script_name);
+		print_python_error();
+		return NULL;
+	}
+
+#ifdef JOB_SUBMIT_PYTHON_NO_LOCK
+	// The import may not have run the module, so nothing can be pruned yet
+	periodic_task_load_end(script_name, generation, false);
 
-		// Reload the module to ensure live updating the script works
-		PyObject* pModule = PyImport_ReloadModule(pModuleInitial);
-		Py_DECREF(pModuleInitial);
+	struct script_version version;
+	if (!script_changed(pModuleInitial, script_name, &version))
+		return pModuleInitial;
 
-		return pModule;
+	// Wait without holding the GIL as the thread reloading may need it
+	Py_BEGIN_ALLOW_THREADS
+	slurm_mutex_lock(&load_lock);
+	Py_END_ALLOW_THREADS
+
+	// Another thread may have reloaded it while this one waited
+	if (!script_changed(pModuleInitial, script_name, &version))
+	{
+		slurm_mutex_unlock(&load_lock);
+		return pModuleInitial;
 	}
+	generation = periodic_task_load_begin();
+#endif
+
+	verbose("job_submit_python: Loaded \"%s\"", script_name);
 
-	error("job_submit_python: Failed to load \"%s\"", script_name);
-	print_python_error();
+	// Reload the module to ensure live updating the script works
+	PyObject* pModule = PyImport_ReloadModule(pModuleInitial);
+	Py_DECREF(pModuleInitial);
+	periodic_task_load_end(script_name, generation, pModule != NULL);
 
-	return pModuleInitial;
+#ifdef JOB_SUBMIT_PYTHON_NO_LOCK
+	if (pModule != NULL)
+		script_loaded(script_name, &version);
+	slurm_mutex_unlock(&load_lock);
+#endif
+
+	if (pModule == NULL)
+	{
+		error("job_submit_python: Failed to load \"%s\"", script_name);
+		print_python_error();
+	}
+	return pModule;
 }
 
 /*
- * Load and run the job submit script and call the ``job_submit`` function
+ * Load and run the job submit script and call the ``job_submit`` function.
+ * Must be called with the GIL and a call context.
  */
-extern int job_submit(struct job_descriptor *job_desc, uint32_t submit_uid, char **err_msg)
+static int call_job_submit(struct job_descriptor *job_desc, uint32_t submit_uid, char **err_msg)
 {
-	slurm_mutex_lock(&python_lock);
-
-	PyObject* pModule = load_script();
+	int span = trace_span_begin("load module");
+	PyObject* pModule = load_script("job_submit");
+	trace_span_end(span);
 	if (pModule != NULL)
 	{
 		PyObject* pFunc = PyObject_GetAttrString(pModule, "job_submit");
 		if (pFunc && PyCallable_Check(pFunc))
 		{
+			span = trace_span_begin("build descriptor");
 			PyObject* pJobDesc = create_job_desc_dict(job_desc);
 			PyObject* p_submit_uid = PyLong_FromUnsignedLongLong(submit_uid);
+			trace_span_end(span);
+
+			PyObject* pShadowDesc = NULL;
+			if (shadow_sampled())
+			{
+				span = trace_span_begin("shadow copy");
+				pShadowDesc = shadow_copy_descriptor(pJobDesc);
+				trace_span_end(span);
+			}
 
+			span = trace_span_begin("python call");
+			profile_start();
+			struct mem_call mem;
+			mem_call_begin(&mem);
+			uint64_t start = monotonic_ns();
 			PyObject* pRc = PyObject_CallFunctionObjArgs(pFunc, pJobDesc, p_submit_uid, NULL);
+			bool over_budget = mem_call_end(&mem);
+			if (conf.shadow_module)
+				latency_record(&shadow_live_latency, monotonic_ns() - start);
+			profile_stop();
+			trace_span_end(span);
 			Py_DECREF(p_submit_uid);
 
+			// Whatever the script did after going over its budget cannot be
+			// trusted, so none of its changes are applied
+			if (over_budget)
+			{
+				error("job_submit_python: Policy went over its memory budget of %u MB, %s the job",
+				      conf.memory_budget, conf.memory_budget_reject ? "rejecting" : "accepting");
+				print_python_error();
+				Py_XDECREF(pRc);
+				Py_XDECREF(pShadowDesc);
+				Py_DECREF(pJobDesc);
+				Py_DECREF(pFunc);
+				Py_DECREF(pModule);
+
+				if (!conf.memory_budget_reject)
+					return SLURM_SUCCESS;
+				*err_msg = xstrdup("Job submit policy went over its memory budget");
+				return SLURM_ERROR;
+			}
+
 			if (pRc != NULL)
 			{
 				if(!PyLong_Check(pRc))
 				{
 					error("job_submit_python: return value of function must be an integer, not %s", Py_TYPE(pRc)->tp_name);
 					Py_DECREF(pRc);
+					Py_XDECREF(pShadowDesc);
 					Py_DECREF(pJobDesc);
 					Py_DECREF(pFunc);
 					Py_DECREF(pModule);
@@ -844,32 +4600,42 @@ extern int job_submit(struct job_descriptor *job_desc, uint32_t submit_uid, char
 				long rc = PyLong_AsLong(pRc);
 				Py_DECREF(pRc);
 
+				// Writing back consumes the environment dicts, so the
+				// decision given to the shadow thread must be a copy
+				if (pShadowDesc)
+				{
+					span = trace_span_begin("shadow copy");
+					shadow_submit(pShadowDesc, shadow_copy_descriptor(pJobDesc), submit_uid, rc);
+					trace_span_end(span);
+				}
+
+				span = trace_span_begin("write back");
 				retrieve_job_desc_dict(job_desc, pJobDesc);
+				trace_span_end(span);
 				Py_DECREF(pJobDesc);
 
-				if (user_msg) {
-					*err_msg = user_msg;
-					user_msg = NULL;
+				if (current_context->user_msg) {
+					*err_msg = current_context->user_msg;
+					current_context->user_msg = NULL;
 				}
 
 				if (rc != SLURM_SUCCESS)
 				{
 					Py_DECREF(pFunc);
 					Py_DECREF(pModule);
-					slurm_mutex_unlock(&python_lock);
 					return rc;
 				}
 			}
 			else
 			{
-				Py_DECREF(pJobDesc);
+				Py_XDECREF(pShadowDesc);
+				Py_XDECREF(pJobDesc);
 				Py_DECREF(pFunc);
 				Py_DECREF(pModule);
 
 				error("job_submit_python: Call failed");
 				print_python_error();
 
-				slurm_mutex_unlock(&python_lock);
 				return SLURM_ERROR;
 			}
 		}
@@ -880,7 +4646,6 @@ extern int job_submit(struct job_descriptor *job_desc, uint32_t submit_uid, char
 
 			Py_XDECREF(pFunc);
 			Py_DECREF(pModule);
-			slurm_mutex_unlock(&python_lock);
 			return SLURM_ERROR;
 		}
 		Py_XDECREF(pFunc);
@@ -889,18 +4654,49 @@ extern int job_submit(struct job_descriptor *job_desc, uint32_t submit_uid, char
 	else
 	{
 		print_python_error();
-		slurm_mutex_unlock(&python_lock);
 		return SLURM_ERROR;
 	}
 
-	slurm_mutex_unlock(&python_lock);
 	return SLURM_SUCCESS;
 }
 
+extern int job_submit(struct job_descriptor *job_desc, uint32_t submit_uid, char **err_msg)
+{
+	struct call_context ctx;
+
+	__atomic_fetch_add(&calls_in_flight, 1, __ATOMIC_RELAXED);
+	trace_begin(submit_uid);
+
+	int span = trace_span_begin("lock wait");
+#ifndef JOB_SUBMIT_PYTHON_NO_LOCK
+	slurm_mutex_lock(&python_lock);
+#endif
+	// Attach a Python thread state to this RPC thread
+	PyGILState_STATE gstate = PyGILState_Ensure();
+	trace_span_end(span);
+
+	call_context_begin(&ctx);
+	int rc = call_job_submit(job_desc, submit_uid, err_msg);
+	int errors = ctx.errors;
+	call_context_end(&ctx);
+
+	PyGILState_Release(gstate);
+#ifndef JOB_SUBMIT_PYTHON_NO_LOCK
+	slurm_mutex_unlock(&python_lock);
+#endif
+
+	trace_end(rc, errors);
+	__atomic_fetch_add(&calls_completed, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_sub(&calls_in_flight, 1, __ATOMIC_RELAXED);
+	return rc;
+}
+
 extern int job_modify(struct job_descriptor *job_desc, struct job_record *job_ptr, uint32_t submit_uid)
 {
+#ifndef JOB_SUBMIT_PYTHON_NO_LOCK
 	slurm_mutex_lock(&python_lock);
 	slurm_mutex_unlock(&python_lock);
+#endif
 	return SLURM_SUCCESS;
 }
 
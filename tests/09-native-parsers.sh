@@ -0,0 +1,39 @@
+#!/bin/bash
+set -euo pipefail
+IFS=$'\n\t'
+
+cat << EOF > /etc/slurm/job_submit.py
+import slurm
+def job_submit(job_desc, submit_uid):
+    gpus = slurm.parse_tres("gres:gpu:tesla:2,cpu=4")
+    slurm.user_msg("tres %s %s %d" % (gpus[0]["type"], gpus[0]["name"], gpus[0]["count"]))
+    slurm.user_msg("format %s" % slurm.format_tres(gpus))
+    slurm.user_msg("bare %s" % slurm.format_tres(slurm.parse_tres("gpu:2,gpu:tesla:2")))
+    slurm.user_msg("mem %d" % slurm.parse_tres("mem=1G")[0]["count"])
+    slurm.user_msg("count %d" % slurm.hostlist_count("node[001-100]"))
+    slurm.user_msg("expand %s" % ",".join(slurm.hostlist_expand("node[1-3]")))
+    slurm.user_msg("compress %s" % slurm.hostlist_compress(["node1", "node2", "node3"]))
+    slurm.user_msg("time %d" % slurm.parse_time("1-00:30:00"))
+    slurm.user_msg("format_time %s" % slurm.format_time(90))
+    return 1
+EOF
+
+set +e
+MESSAGE=$(
+sbatch 2>&1 <<EOF
+#! /bin/bash
+EOF
+)
+set -e
+
+scancel -u root
+
+if [[ $MESSAGE != *"tres gres/gpu tesla 2"* ]]; then echo "TRES not parsed correctly"; exit 1; fi
+if [[ $MESSAGE != *"format gres:gpu:tesla:2,cpu=4"* ]]; then echo "TRES not formatted correctly"; exit 1; fi
+if [[ $MESSAGE != *"bare gpu:2,gpu:tesla:2"* ]]; then echo "Bare GRES not formatted correctly"; exit 1; fi
+if [[ $MESSAGE != *"mem 1024"* ]]; then echo "Memory TRES not in megabytes"; exit 1; fi
+if [[ $MESSAGE != *"count 100"* ]]; then echo "Hostlist not counted correctly"; exit 1; fi
+if [[ $MESSAGE != *"expand node1,node2,node3"* ]]; then echo "Hostlist not expanded correctly"; exit 1; fi
+if [[ $MESSAGE != *"compress node[1-3]"* ]]; then echo "Hostlist not compressed correctly"; exit 1; fi
+if [[ $MESSAGE != *"time 1470"* ]]; then echo "Time not parsed correctly"; exit 1; fi
+if [[ $MESSAGE != *"format_time 01:30:00"* ]]; then echo "Time not formatted correctly"; exit 1; fi
@@ -0,0 +1,53 @@
+#!/bin/bash
+set -euo pipefail
+IFS=$'\n\t'
+
+cat << EOF > /etc/slurm/job_submit.py
+import slurm
+
+def load_value():
+    return "precomputed value"
+
+slurm.every(1, load_value)
+
+def job_submit(job_desc, submit_uid):
+    slurm.user_msg("result %s" % slurm.result(load_value))
+    slurm.user_msg("runs %d" % slurm.stats()["tasks"]["job_submit.load_value"]["runs"])
+    return 1
+EOF
+
+set +e
+sbatch <<EOF
+#! /bin/bash
+EOF
+
+sleep 3
+
+MESSAGE=$(
+sbatch 2>&1 <<EOF
+#! /bin/bash
+EOF
+)
+set -e
+
+cat << EOF > /etc/slurm/job_submit.py
+import slurm
+
+def job_submit(job_desc, submit_uid):
+    slurm.user_msg("tasks %s" % sorted(slurm.stats()["tasks"]))
+    return 1
+EOF
+
+set +e
+DROPPED=$(
+sbatch 2>&1 <<EOF
+#! /bin/bash
+EOF
+)
+set -e
+
+scancel -u root
+
+if [[ $DROPPED != *"tasks []"* ]]; then echo "Removed periodic task still registered"; exit 1; fi
+if [[ $MESSAGE != *"result precomputed value"* ]]; then echo "Periodic task result not published"; exit 1; fi
+if [[ $MESSAGE == *"runs 0"* ]]; then echo "Periodic task not run"; exit 1; fi
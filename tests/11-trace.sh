@@ -0,0 +1,31 @@
+#!/bin/bash
+set -euo pipefail
+IFS=$'\n\t'
+
+rm -f /tmp/job_submit_trace.json
+echo "TraceFile=/tmp/job_submit_trace.json" > /etc/slurm/job_submit_python.conf
+supervisorctl restart slurmctld
+
+cat << EOF > /etc/slurm/job_submit.py
+import slurm
+def job_submit(job_desc, submit_uid):
+    with slurm.span("custom span"):
+        job_desc.comment = "traced"
+    return 0
+EOF
+
+sbatch <<EOF
+#! /bin/bash
+EOF
+
+sleep 3
+
+TRACE=$(cat /tmp/job_submit_trace.json)
+
+scancel -u root
+rm -f /etc/slurm/job_submit_python.conf
+supervisorctl restart slurmctld
+
+if [[ $TRACE != "["* ]]; then echo "Trace file is not a JSON array"; exit 1; fi
+if [[ $TRACE != *'"name":"python call"'* ]]; then echo "Python call span not traced"; exit 1; fi
+if [[ $TRACE != *'"name":"custom span"'* ]]; then echo "User span not traced"; exit 1; fi
@@ -0,0 +1,34 @@
+#!/bin/bash
+set -euo pipefail
+IFS=$'\n\t'
+
+rm -f /tmp/job_submit_profile.txt
+cat << EOF > /etc/slurm/job_submit_python.conf
+ProfileInterval=1
+ProfileFile=/tmp/job_submit_profile.txt
+ProfileDumpInterval=1
+EOF
+supervisorctl restart slurmctld
+
+cat << EOF > /etc/slurm/job_submit.py
+import slurm
+def busy_policy():
+    return sum(i * i for i in range(2000000))
+def job_submit(job_desc, submit_uid):
+    busy_policy()
+    return 0
+EOF
+
+sbatch <<EOF
+#! /bin/bash
+EOF
+
+sleep 3
+
+PROFILE=$(cat /tmp/job_submit_profile.txt)
+
+scancel -u root
+rm -f /etc/slurm/job_submit_python.conf
+supervisorctl restart slurmctld
+
+if [[ $PROFILE != *"job_submit.py:job_submit;job_submit.py:busy_policy"* ]]; then echo "Policy function not sampled"; exit 1; fi
@@ -0,0 +1,29 @@
+#!/bin/bash
+set -euo pipefail
+IFS=$'\n\t'
+
+cat << EOF > /etc/slurm/job_submit.py
+import slurm
+def job_submit(job_desc, submit_uid):
+    slurm.user_msg("user %s" % slurm.user(submit_uid)["name"])
+    slurm.user_msg("groups %s" % ",".join(slurm.groups(submit_uid)))
+    slurm.user_msg("missing %s" % slurm.user(987654321))
+    slurm.user(submit_uid)
+    slurm.user_msg("hits %d" % slurm.stats()["identity_cache"]["hits"])
+    return 1
+EOF
+
+set +e
+MESSAGE=$(
+sbatch 2>&1 <<EOF
+#! /bin/bash
+EOF
+)
+set -e
+
+scancel -u root
+
+if [[ $MESSAGE != *"user root"* ]]; then echo "User not looked up"; exit 1; fi
+if [[ $MESSAGE != *"groups root"* ]]; then echo "Groups not looked up"; exit 1; fi
+if [[ $MESSAGE != *"missing None"* ]]; then echo "Unknown user not reported as None"; exit 1; fi
+if [[ $MESSAGE == *"hits 0"* ]]; then echo "Cache not used"; exit 1; fi
@@ -0,0 +1,59 @@
+#!/bin/bash
+set -euo pipefail
+IFS=$'\n\t'
+
+echo "ShadowModule=job_submit_candidate" > /etc/slurm/job_submit_python.conf
+supervisorctl restart slurmctld
+
+cat << EOF > /etc/slurm/job_submit_candidate.py
+import slurm
+def job_submit(job_desc, submit_uid):
+    job_desc.partition = "candidate"
+    slurm.user_msg("from candidate")
+    return 0
+EOF
+
+cat << EOF > /etc/slurm/job_submit.py
+def job_submit(job_desc, submit_uid):
+    job_desc.partition = "debug"
+    return 0
+EOF
+
+JID=$(
+sbatch --parsable <<EOF
+#! /bin/bash
+hostname
+EOF
+)
+
+sleep 1
+
+cat << EOF > /etc/slurm/job_submit.py
+import slurm
+def job_submit(job_desc, submit_uid):
+    shadow = slurm.stats()["shadow"]
+    slurm.user_msg("runs %d" % shadow["runs"])
+    slurm.user_msg("partition diffs %d" % shadow["field_diffs"].get("partition", 0))
+    slurm.user_msg("live calls %d" % shadow["latency"]["live"]["count"])
+    return 1
+EOF
+
+set +e
+MESSAGE=$(
+sbatch 2>&1 <<EOF
+#! /bin/bash
+EOF
+)
+set -e
+
+PARTITION=$(squeue --states all -j "$JID" --Format partition --noheader | xargs)
+
+scancel -u root
+rm -f /etc/slurm/job_submit_python.conf /etc/slurm/job_submit_candidate.py
+supervisorctl restart slurmctld
+
+if [[ $MESSAGE == *"from candidate"* ]]; then echo "Candidate message delivered"; exit 1; fi
+if [[ $MESSAGE == *"runs 0"* ]]; then echo "Candidate not run"; exit 1; fi
+if [[ $MESSAGE != *"partition diffs 1"* ]]; then echo "Partition difference not counted"; exit 1; fi
+if [[ $MESSAGE == *"live calls 0"* ]]; then echo "Live latency not recorded"; exit 1; fi
+if [[ $PARTITION != "debug" ]]; then echo "Partition should be \"debug\" but is \"$PARTITION\""; exit 1; fi
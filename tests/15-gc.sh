@@ -0,0 +1,55 @@
+#!/bin/bash
+set -euo pipefail
+IFS=$'\n\t'
+
+cat << EOF > /etc/slurm/job_submit_python.conf
+GCIdleInterval=10
+GCThreshold=100,10,10
+EOF
+supervisorctl restart slurmctld
+
+cat << EOF > /etc/slurm/job_submit.py
+def job_submit(job_desc, submit_uid):
+    for i in range(1000):
+        cycle = []
+        cycle.append(cycle)
+    return 0
+EOF
+
+sbatch <<EOF
+#! /bin/bash
+EOF
+
+sleep 3
+
+cat << EOF > /etc/slurm/job_submit.py
+import gc
+import slurm
+def job_submit(job_desc, submit_uid):
+    stats = slurm.stats()["gc"]
+    slurm.user_msg("frozen %s" % stats["frozen"])
+    slurm.user_msg("can freeze %s" % hasattr(gc, "freeze"))
+    slurm.user_msg("inline %d" % stats["inline"])
+    slurm.user_msg("background %d" % stats["background"])
+    slurm.user_msg("threshold %s" % (gc.get_threshold(),))
+    return 1
+EOF
+
+set +e
+MESSAGE=$(
+sbatch 2>&1 <<EOF
+#! /bin/bash
+EOF
+)
+set -e
+
+scancel -u root
+rm -f /etc/slurm/job_submit_python.conf
+supervisorctl restart slurmctld
+
+# gc.freeze() only exists from Python 3.7
+if [[ $MESSAGE == *"can freeze True"* && $MESSAGE != *"frozen True"* ]]; then echo "Collector not frozen"; exit 1; fi
+if [[ $MESSAGE == *"can freeze False"* && $MESSAGE != *"frozen False"* ]]; then echo "Collector reported frozen without gc.freeze()"; exit 1; fi
+if [[ $MESSAGE != *"inline 0"* ]]; then echo "Collection ran inline"; exit 1; fi
+if [[ $MESSAGE == *"background 0"* ]]; then echo "No background collection"; exit 1; fi
+if [[ $MESSAGE != *"threshold (100, 10, 10)"* ]]; then echo "Threshold not applied"; exit 1; fi
@@ -0,0 +1,81 @@
+#!/bin/bash
+set -euo pipefail
+IFS=$'\n\t'
+
+echo "MemoryBudget=10" > /etc/slurm/job_submit_python.conf
+supervisorctl restart slurmctld
+
+cat << EOF > /etc/slurm/job_submit.py
+def job_submit(job_desc, submit_uid):
+    job_desc.comment = "x" * (100 * 1024 * 1024)
+    return 0
+EOF
+
+set +e
+MESSAGE=$(
+sbatch 2>&1 <<EOF
+#! /bin/bash
+EOF
+)
+set -e
+
+cat << EOF > /etc/slurm/job_submit.py
+def job_submit(job_desc, submit_uid):
+    names = [str(i) for i in range(10000)]
+    job_desc.partition = "debug"
+    return 0
+EOF
+
+WITHIN_JID=$(
+sbatch --parsable <<EOF
+#! /bin/bash
+hostname
+EOF
+)
+
+WITHIN_PARTITION=$(squeue --states all -j "$WITHIN_JID" --Format partition --noheader | xargs)
+
+cat << EOF > /etc/slurm/job_submit.py
+import slurm
+def job_submit(job_desc, submit_uid):
+    memory = slurm.stats()["memory"]
+    slurm.user_msg("exceeded %d" % memory["exceeded"])
+    return 1
+EOF
+
+set +e
+STATS=$(
+sbatch 2>&1 <<EOF
+#! /bin/bash
+EOF
+)
+set -e
+
+printf "MemoryBudget=10\nMemoryBudgetAction=accept\n" > /etc/slurm/job_submit_python.conf
+supervisorctl restart slurmctld
+
+cat << EOF > /etc/slurm/job_submit.py
+def job_submit(job_desc, submit_uid):
+    job_desc.partition = "debug"
+    job_desc.comment = "x" * (100 * 1024 * 1024)
+    return 0
+EOF
+
+ACCEPTED_JID=$(
+sbatch --parsable <<EOF
+#! /bin/bash
+hostname
+EOF
+)
+
+ACCEPTED_PARTITION=$(squeue --states all -j "$ACCEPTED_JID" --Format partition --noheader | xargs)
+
+scancel -u root
+rm -f /etc/slurm/job_submit_python.conf
+supervisorctl restart slurmctld
+
+if [[ $MESSAGE != *"went over its memory budget"* ]]; then echo "Job not rejected"; exit 1; fi
+if [[ $WITHIN_PARTITION != "debug" ]]; then echo "Job within budget not changed, partition is \"$WITHIN_PARTITION\""; exit 1; fi
+if [[ $STATS != *"exceeded 1"* ]]; then echo "Exceeded budget not counted"; exit 1; fi
+if [[ -z $ACCEPTED_PARTITION ]]; then echo "Job over budget not accepted"; exit 1; fi
+if [[ $ACCEPTED_PARTITION == "debug" ]]; then echo "Job over budget accepted with the policy's changes"; exit 1; fi